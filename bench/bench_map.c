@@ -0,0 +1,321 @@
+/*
+fuserescue, an on demand data recovery tool which recovers data on a first access basis.
+Copyright (C) 2018 Daniel Abrecht
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include <fuserescue/fuserescue.h>
+#include <fuserescue/map.h>
+#include <fuserescue/recover.h>
+#include <fuserescue/utils.h>
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+
+static const char map_states[] = "?*/-+";
+
+static uint64_t now_ns(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Writes a ddrescue mapfile with count entries, optionally in random order
+static bool write_map(const char* path, size_t count, bool shuffle){
+  struct mapentry* entries = malloc(count * sizeof(*entries));
+  if(!entries)
+    return false;
+  uint64_t offset = 0;
+  srand(1);
+  for(size_t i=0; i<count; i++){
+    entries[i].offset = offset;
+    entries[i].size = (uint64_t)(rand() % 64 + 1) * 0x200;
+    entries[i].state = i % 5;
+    offset += entries[i].size;
+  }
+  if(shuffle){
+    for(size_t i=count; i>1; i--){
+      size_t j = (size_t)rand() % i;
+      struct mapentry e = entries[i-1];
+      entries[i-1] = entries[j];
+      entries[j] = e;
+    }
+  }
+  FILE* f = fopen(path,"w");
+  if(!f){
+    free(entries);
+    return false;
+  }
+  fprintf(f,"# Mapfile. Created by bench_map\n0x0  +\n");
+  for(size_t i=0; i<count; i++)
+    fprintf(f,"0x%08"PRIX64"  0x%08"PRIX64"  %c\n",entries[i].offset,entries[i].size,map_states[entries[i].state]);
+  free(entries);
+  return !fclose(f);
+}
+
+#define OPS_MAX 1000000 // for the benchmarks which don't go over every entry
+#define LOOKUP_SIZE 0x20000 // a typical fuse read
+
+static uint64_t map_end(struct mapfile* map){
+  struct map_iterator it;
+  struct mapentry entry;
+  uint64_t end = 0;
+  map_iterate(map,&it,0);
+  while(map_next(&it,&entry))
+    end = entry.offset + entry.size;
+  return end;
+}
+
+static struct mapfile* load(const char* path){
+  struct mapfile* map = map_read(path);
+  if(!map){
+    fprintf(stderr,"map_read failed\n");
+    exit(1);
+  }
+  return map;
+}
+
+// Each benchmark returns the nanoseconds per operation
+static double bench_read(const char* path, size_t count){
+  uint64_t start = now_ns();
+  struct mapfile* map = load(path);
+  uint64_t time = now_ns() - start;
+  map_free(map);
+  return (double)time / count;
+}
+
+// The map is normalized already, but map_normalize still checks every entry, as on every full save
+static double bench_normalize(const char* path, size_t count){
+  struct mapfile* map = load(path);
+  uint64_t start = now_ns();
+  if(!map_normalize(map)){
+    fprintf(stderr,"map_normalize failed\n");
+    exit(1);
+  }
+  uint64_t time = now_ns() - start;
+  map_free(map);
+  return (double)time / count;
+}
+
+static double bench_write(const char* path, size_t count){
+  struct mapfile* map = load(path);
+  char out[strlen(path)+sizeof(".out")];
+  sprintf(out,"%s.out",path);
+  int fd = open(out,O_CREAT|O_WRONLY|O_TRUNC,0600);
+  if(fd == -1){
+    perror("open failed");
+    exit(1);
+  }
+  uint64_t start = now_ns();
+  if(!map_write(map,fd)){
+    perror("map_write failed");
+    exit(1);
+  }
+  uint64_t time = now_ns() - start;
+  close(fd);
+  unlink(out);
+  map_free(map);
+  return (double)time / count;
+}
+
+enum update_pattern {
+  UPDATE_SEQUENTIAL, // small finished pieces one after another, like a forward pass
+  UPDATE_RANDOM, // random sizes and states all over the map
+  UPDATE_FRAGMENT // every other sector becomes a bad sector, adding two boundaries each time
+};
+
+static double bench_update(const char* path, size_t count, enum update_pattern pattern){
+  struct mapfile* map = load(path);
+  uint64_t end = map_end(map);
+  size_t ops = count < OPS_MAX ? count : OPS_MAX;
+  srand(2);
+  uint64_t start = now_ns();
+  for(size_t i=0; i<ops; i++){
+    switch(pattern){
+      case UPDATE_SEQUENTIAL: {
+        uint64_t s = (uint64_t)i * 0x200;
+        map_update(map,s,s+0x200,ME_FINISHED);
+      } break;
+      case UPDATE_RANDOM: {
+        uint64_t s = ((uint64_t)rand() << 31 ^ rand()) % end / 0x200 * 0x200;
+        map_update(map,s,s+(uint64_t)(rand() % 64 + 1) * 0x200,rand() % 5);
+      } break;
+      case UPDATE_FRAGMENT: {
+        uint64_t s = (uint64_t)i * 0x400 % end;
+        map_update(map,s,s+0x200,ME_BAD_SECTOR);
+      } break;
+    }
+  }
+  uint64_t time = now_ns() - start;
+  map_free(map);
+  return (double)time / ops;
+}
+
+// What save and show map do under the lock, plus copying what the next update changes
+static double bench_snapshot(const char* path, size_t count){
+  struct mapfile* map = load(path);
+  uint64_t end = map_end(map);
+  size_t ops = count < OPS_MAX ? count : OPS_MAX;
+  srand(4);
+  uint64_t start = now_ns();
+  for(size_t i=0; i<ops; i++){
+    struct mapfile* snapshot = map_clone(map);
+    uint64_t s = ((uint64_t)rand() << 31 ^ rand()) % end / 0x200 * 0x200;
+    map_update(map,s,s+0x200,ME_BAD_SECTOR);
+    map_free(snapshot);
+  }
+  uint64_t time = now_ns() - start;
+  map_free(map);
+  return (double)time / ops;
+}
+
+// The map lookup done for every fuse read
+static double bench_classify(const char* path, size_t count){
+  struct fuserescue fr = {
+    .map = load(path),
+    .recover_states = (1lu<<ME_NON_TRIED) | (1lu<<ME_NON_TRIMMED)
+  };
+  uint64_t end = map_end(fr.map);
+  size_t ops = count < OPS_MAX ? count : OPS_MAX;
+  struct range_list finished = {0};
+  struct range_list to_recover = {0};
+  srand(3);
+  uint64_t start = now_ns();
+  for(size_t i=0; i<ops; i++){
+    uint64_t s = ((uint64_t)rand() << 31 ^ rand()) % end;
+    classify_range(&fr,s,s+LOOKUP_SIZE,&finished,&to_recover);
+    finished.count = 0;
+    to_recover.count = 0;
+  }
+  uint64_t time = now_ns() - start;
+  range_list_clear(&finished);
+  range_list_clear(&to_recover);
+  map_free(fr.map);
+  return (double)time / ops;
+}
+
+enum benchmark {
+  BENCH_READ,
+  BENCH_READ_SHUFFLED,
+  BENCH_NORMALIZE,
+  BENCH_WRITE,
+  BENCH_UPDATE_SEQUENTIAL,
+  BENCH_UPDATE_RANDOM,
+  BENCH_UPDATE_FRAGMENT,
+  BENCH_SNAPSHOT,
+  BENCH_CLASSIFY,
+  BENCH_COUNT
+};
+
+static const char* const bench_name[] = {
+  [BENCH_READ] = "map_read sorted",
+  [BENCH_READ_SHUFFLED] = "map_read shuffled",
+  [BENCH_NORMALIZE] = "map_normalize",
+  [BENCH_WRITE] = "map_write",
+  [BENCH_UPDATE_SEQUENTIAL] = "map_update sequential",
+  [BENCH_UPDATE_RANDOM] = "map_update random",
+  [BENCH_UPDATE_FRAGMENT] = "map_update fragment",
+  [BENCH_SNAPSHOT] = "map_clone and update",
+  [BENCH_CLASSIFY] = "classify_range"
+};
+
+static double run(enum benchmark b, const char* path, const char* shuffled, size_t count){
+  switch(b){
+    case BENCH_READ: return bench_read(path,count);
+    case BENCH_READ_SHUFFLED: return bench_read(shuffled,count);
+    case BENCH_NORMALIZE: return bench_normalize(path,count);
+    case BENCH_WRITE: return bench_write(path,count);
+    case BENCH_UPDATE_SEQUENTIAL: return bench_update(path,count,UPDATE_SEQUENTIAL);
+    case BENCH_UPDATE_RANDOM: return bench_update(path,count,UPDATE_RANDOM);
+    case BENCH_UPDATE_FRAGMENT: return bench_update(path,count,UPDATE_FRAGMENT);
+    case BENCH_SNAPSHOT: return bench_snapshot(path,count);
+    case BENCH_CLASSIFY: return bench_classify(path,count);
+    case BENCH_COUNT: break;
+  }
+  return 0;
+}
+
+// Every benchmark runs in its own process, so the peak RSS is its own
+static void bench(enum benchmark b, const char* path, const char* shuffled, size_t count){
+  fflush(stdout);
+  pid_t pid = fork();
+  if(pid == -1){
+    perror("fork failed");
+    exit(1);
+  }
+  if(!pid){
+    double ns = run(b,path,shuffled,count);
+    struct rusage usage;
+    getrusage(RUSAGE_SELF,&usage);
+    printf("%-22s %10zu entries %12.1f ns/op %10ld KiB peak RSS\n",bench_name[b],count,ns,usage.ru_maxrss);
+    fflush(stdout);
+    _exit(0);
+  }
+  int status;
+  if(waitpid(pid,&status,0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status)){
+    fprintf(stderr,"%s failed\n",bench_name[b]);
+    exit(1);
+  }
+}
+
+int main(int argc, char* argv[]){
+  uint64_t max = 10000000;
+  if(argc > 2){
+    fprintf(stderr,"usage: %s [max_entries]\n",argv[0]);
+    return 1;
+  }
+  if(argc == 2){
+    const char* s = argv[1];
+    if(!parseu64(&s,&max) || *s){
+      fprintf(stderr,"invalid number of entries\n");
+      return 1;
+    }
+  }
+  const char* tmpdir = getenv("TMPDIR");
+  char path[256];
+  char shuffled[256];
+  snprintf(path,sizeof(path),"%s/bench_map.XXXXXX",tmpdir?tmpdir:"/tmp");
+  snprintf(shuffled,sizeof(shuffled),"%s/bench_map.XXXXXX",tmpdir?tmpdir:"/tmp");
+  int fd = mkstemp(path);
+  int fd2 = mkstemp(shuffled);
+  if(fd == -1 || fd2 == -1){
+    perror("mkstemp failed");
+    return 1;
+  }
+  close(fd);
+  close(fd2);
+  for(uint64_t count=1000; count<=max; count*=10){
+    if(!write_map(path,count,false) || !write_map(shuffled,count,true)){
+      perror("failed to write mapfile");
+      return 1;
+    }
+    for(enum benchmark b=0; b<BENCH_COUNT; b++)
+      bench(b,path,shuffled,count);
+  }
+  unlink(path);
+  unlink(shuffled);
+  return 0;
+}
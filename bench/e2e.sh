@@ -0,0 +1,187 @@
+#!/bin/sh
+# Mounts fuserescue over a simulated failing drive and measures some workloads
+# through it, each starting with nothing recovered yet:
+#  sequential  reading the whole image
+#  random-4k   reading 4 KiB at random offsets
+#  find        attaching the image with losetup -P, mounting the ext4 file system
+#              in its partition and walking it with find
+#  copy        the same, but reading all the files on it
+# The last two need root and are skipped otherwise. For them, the time to first
+# byte is how long it took to mount the file system. The latency is that of the
+# reads of the image as fuserescue answered them, taken from its --trace, and the
+# seeks are the device reads which didn't continue where the previous one ended.
+#
+# SIZE      image size in MiB, 256 per default
+# BAD       distance of the bad sectors and weak areas in MiB, 16 per default
+# SIMULATE  simulation options, see --simulate
+# OPTIONS   further options for fuserescue
+# KEEP      keep the working directory, with the logs, traces and stats
+
+set -e
+
+cd "$(dirname "$0")/.."
+size=${SIZE:-256}
+bad=${BAD:-16}
+simulate=${SIMULATE:-sector=4,seek=10000,bad=200000,retries=2}
+options=${OPTIONS:---infile-no-direct-io --adaptive}
+
+for program in bin/fuserescue bin/readbench bin/replay; do
+  if [ ! -x "$program" ]; then
+    echo "$program is missing, use make e2e" >&2
+    exit 1
+  fi
+done
+for program in mkfs.ext4 sfdisk split; do
+  if ! command -v "$program" >/dev/null; then
+    echo "$program is missing" >&2
+    exit 1
+  fi
+done
+
+work=$(mktemp -d)
+pid=
+device=
+
+cleanup(){
+  set +e
+  if [ -n "$device" ]; then
+    umount "$work/fs" 2>/dev/null
+    losetup -d "$device"
+  fi
+  if [ -n "$pid" ]; then
+    kill "$pid"
+    wait "$pid"
+  fi
+  if [ -n "$KEEP" ]; then
+    echo "kept $work"
+  else
+    rm -rf "$work"
+  fi
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+now(){
+  date +%s%N
+}
+
+# A partitioned image with an ext4 file system holding a few big and many small files
+mkdir "$work/tree"
+i=0
+while [ $i -lt 8 ]; do
+  head -c $((size / 32))M /dev/urandom > "$work/tree/big$i"
+  mkdir "$work/tree/dir$i"
+  head -c 1M /dev/urandom | split -a 3 -b 4096 - "$work/tree/dir$i/file"
+  i=$((i + 1))
+done
+truncate -s "${size}M" "$work/image"
+printf 'label: dos\nstart=2048, type=83\n' | sfdisk -q "$work/image"
+mkfs.ext4 -q -F -E offset=1048576 -d "$work/tree" "$work/image" "$((size - 1))M"
+bytes=$(du -sb "$work/tree" | cut -f1)
+rm -rf "$work/tree"
+
+# Every $bad MiB, a bad sector and, 64 KiB later, a weak area of 64 KiB which fails a few times
+awk -v size=$((size << 20)) -v step=$((bad << 20)) 'BEGIN {
+  print "# Mapfile"
+  print "0 +"
+  pos = 0
+  for(at = step; at + 131072 <= size; at += step){
+    printf "%.0f %.0f +\n", pos, at - pos
+    printf "%.0f %.0f -\n", at, 512
+    printf "%.0f %.0f +\n", at + 512, 65536 - 512
+    printf "%.0f %.0f /\n", at + 65536, 65536
+    pos = at + 131072
+  }
+  if(pos < size)
+    printf "%.0f %.0f +\n", pos, size - pos
+}' > "$work/bad.map"
+
+mkfifo "$work/control"
+
+start(){
+  rm -f "$work/out" "$work/out.map" "$work/stats.json" "$work/trace"
+  : > "$work/mnt"
+  bin/fuserescue $options --simulate="$work/bad.map,$simulate" \
+    --stats-file="$work/stats.json" --stats-format=json --stats-interval=0 --trace="$work/trace" \
+    "$work/image" "$work/out" "$work/out.map" "$work/mnt" < "$work/control" > "$work/$1.log" 2>&1 &
+  pid=$!
+  exec 3> "$work/control"
+  echo "recovery allow" >&3
+  while ! grep -q "recovery mode: allow" "$work/$1.log" || [ "$(stat -c %s "$work/mnt")" != $((size << 20)) ]; do
+    if ! kill -0 "$pid" 2>/dev/null; then
+      cat "$work/$1.log" >&2
+      exit 1
+    fi
+    sleep 0.1
+  done
+}
+
+stop(){
+  echo exit >&3
+  exec 3>&-
+  wait "$pid"
+  pid=
+}
+
+loop(){
+  device=$(losetup -r -P -f --show "$work/mnt")
+  i=0
+  while [ ! -b "${device}p1" ] && [ $i -lt 50 ]; do
+    sleep 0.1
+    i=$((i + 1))
+  done
+  mkdir -p "$work/fs"
+  mount -o ro,noload "${device}p1" "$work/fs"
+}
+
+unloop(){
+  umount "$work/fs"
+  losetup -d "$device"
+  device=
+}
+
+# name ttfb MiB/s time, completed by what fuserescue saw
+report(){
+  latency=$(bin/replay --fast "$work/trace" "$work/image" | awk '$1 == "recorded:" { print $6, $9 }')
+  seeks=$(sed -n 's/.*"seeks":\([0-9]*\).*/\1/p' "$work/stats.json")
+  eio=$(sed -n 's/.*"eio":{\([^}]*\)}.*/\1/p' "$work/stats.json" | tr ',' '\n' | awk -F: '{ n += $2 } END { print n + 0 }')
+  printf '%-12s %10s %10s %10s %10s %8s %6s %10s\n' "$1" "$2" "$3" ${latency:-- -} "$seeks" "$eio" "$4"
+}
+
+printf '%-12s %10s %10s %10s %10s %8s %6s %10s\n' workload "ttfb ms" "MiB/s" "p50 ms" "p99 ms" seeks EIO "time s"
+
+for workload in sequential random-4k; do
+  start $workload
+  if [ $workload = sequential ]; then
+    result=$(bin/readbench "$work/mnt")
+  else
+    result=$(bin/readbench --random --count=2000 "$work/mnt")
+  fi
+  stop
+  report $workload $(echo "$result" | awk '{ print $2, $4, $16 }')
+done
+
+if [ "$(id -u)" != 0 ]; then
+  echo "find and copy need root, skipped" >&2
+  exit 0
+fi
+
+for workload in find copy; do
+  start $workload
+  t=$(now)
+  loop
+  ttfb=$((($(now) - t) / 1000000))
+  if [ $workload = find ]; then
+    find "$work/fs" > /dev/null
+    throughput=-
+  else
+    tar cf - -C "$work/fs" . | wc -c > /dev/null
+  fi
+  t=$(($(now) - t))
+  unloop
+  stop
+  if [ $workload = copy ]; then
+    throughput=$(awk -v b="$bytes" -v t="$t" 'BEGIN { printf "%.1f", b / 1048576 / (t / 1e9) }')
+  fi
+  report $workload "$ttfb" "$throughput" "$(awk -v t="$t" 'BEGIN { printf "%.3f", t / 1e9 }')"
+done
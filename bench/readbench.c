@@ -0,0 +1,147 @@
+/*
+fuserescue, an on demand data recovery tool which recovers data on a first access basis.
+Copyright (C) 2018 Daniel Abrecht
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <time.h>
+
+/*
+ * Reads a file, usually a mounted image, either from start to end or at random
+ * offsets, and shows how long it took until the first byte arrived, the throughput,
+ * and the latency of the reads. Failed reads are skipped and counted.
+ */
+
+static uint64_t now_ns(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int compare_u64(const void* a, const void* b){
+  uint64_t x = *(const uint64_t*)a;
+  uint64_t y = *(const uint64_t*)b;
+  return x < y ? -1 : x > y;
+}
+
+// xorshift64*, so runs with the same seed read the same offsets everywhere
+static uint64_t next_random(uint64_t* state){
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * 0x2545F4914F6CDD1DULL;
+}
+
+static bool parse_size(const char* arg, const char* name, uint64_t* value){
+  size_t n = strlen(name);
+  if(strncmp(arg,name,n) || arg[n] != '=')
+    return false;
+  char* end;
+  errno = 0;
+  *value = strtoull(arg+n+1,&end,0);
+  if(errno || *end || !*value){
+    fprintf(stderr,"invalid value for %s\n",name);
+    exit(1);
+  }
+  return true;
+}
+
+int main(int argc, char* argv[]){
+  bool shuffle = false;
+  uint64_t bs = 0, count = 0, seed = 1;
+  int i;
+  for(i=1; i<argc-1; i++){
+    if(!strcmp(argv[i],"--random")){
+      shuffle = true;
+    }else if(!parse_size(argv[i],"--bs",&bs)
+          && !parse_size(argv[i],"--count",&count)
+          && !parse_size(argv[i],"--seed",&seed)
+    ) break;
+  }
+  if(i != argc-1){
+    fprintf(stderr,"usage: %s [--random] [--bs=N] [--count=N] [--seed=N] file\n",argv[0]);
+    return 1;
+  }
+  if(!bs)
+    bs = shuffle ? 0x1000 : 0x20000;
+  int fd = open(argv[i],O_RDONLY);
+  if(fd == -1){
+    perror("failed to open file");
+    return 1;
+  }
+  off_t size = lseek(fd,0,SEEK_END);
+  if(size <= 0){
+    fprintf(stderr,"file is empty or its size is unknown\n");
+    return 1;
+  }
+  uint64_t blocks = ((uint64_t)size + bs - 1) / bs;
+  if(!count)
+    count = shuffle ? 1000 : blocks;
+  if(!shuffle && count > blocks)
+    count = blocks;
+
+  char* buf = malloc(bs);
+  uint64_t* latency = malloc(count*sizeof(*latency));
+  if(!buf || !latency){
+    perror("malloc failed");
+    return 1;
+  }
+
+  size_t done = 0, errors = 0;
+  uint64_t bytes = 0, first = 0;
+  uint64_t start = now_ns();
+  for(uint64_t n=0; n<count; n++){
+    uint64_t offset = (shuffle ? next_random(&seed) % blocks : n) * bs;
+    uint64_t t = now_ns();
+    ssize_t ret = pread(fd,buf,bs,offset);
+    uint64_t end = now_ns();
+    if(ret < 0){
+      errors++;
+      continue;
+    }
+    if(!first && ret > 0)
+      first = end - start;
+    bytes += ret;
+    latency[done++] = end - t;
+  }
+  uint64_t total = now_ns() - start;
+
+  printf("ttfb %.3f ms  %.1f MiB/s  ",first/1e6,bytes/1048576.0/(total/1e9));
+  if(done){
+    qsort(latency,done,sizeof(*latency),compare_u64);
+    printf("p50 %.3f ms  p99 %.3f ms  ",latency[done/2]/1e6,latency[done*99/100]/1e6);
+  }else{
+    printf("p50 - ms  p99 - ms  ");
+  }
+  printf("%zu reads  %zu errors  %.3f s\n",done,errors,total/1e9);
+
+  free(latency);
+  free(buf);
+  close(fd);
+  return 0;
+}
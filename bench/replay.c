@@ -0,0 +1,157 @@
+/*
+fuserescue, an on demand data recovery tool which recovers data on a first access basis.
+Copyright (C) 2018 Daniel Abrecht
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include <fuserescue/trace.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+
+/*
+ * Issues the reads recorded with --trace against a mounted image again, one after
+ * another, and compares how long they took and whether they succeeded.
+ */
+
+static uint64_t now_ns(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int compare_u64(const void* a, const void* b){
+  uint64_t x = *(const uint64_t*)a;
+  uint64_t y = *(const uint64_t*)b;
+  return x < y ? -1 : x > y;
+}
+
+static void print_latency(const char* name, uint64_t* latency, size_t count){
+  if(!count)
+    return;
+  uint64_t sum = 0;
+  for(size_t i=0; i<count; i++)
+    sum += latency[i];
+  qsort(latency,count,sizeof(*latency),compare_u64);
+  printf("%-9s avg %10.3f ms  p50 %10.3f ms  p99 %10.3f ms  max %10.3f ms\n", name,
+    sum / 1e6 / count, latency[count/2] / 1e6, latency[count*99/100] / 1e6, latency[count-1] / 1e6);
+}
+
+int main(int argc, char* argv[]){
+  bool timed = true;
+  if(argc == 4 && !strcmp(argv[1],"--fast")){
+    timed = false;
+    argv++;
+    argc--;
+  }
+  if(argc != 3){
+    fprintf(stderr,"usage: %s [--fast] trace image\n",argv[0]);
+    return 1;
+  }
+  FILE* trace = fopen(argv[1],"rb");
+  if(!trace){
+    perror("failed to open trace");
+    return 1;
+  }
+  struct trace_header header;
+  if(fread(&header,sizeof(header),1,trace) != 1 || header.magic != TRACE_MAGIC || header.version != TRACE_VERSION){
+    fprintf(stderr,"not a trace file\n");
+    return 1;
+  }
+  int image = open(argv[2],O_RDONLY);
+  if(image == -1){
+    perror("failed to open image");
+    return 1;
+  }
+
+  size_t count = 0, capacity = 0;
+  uint64_t* recorded = 0;
+  uint64_t* replayed = 0;
+  size_t recorded_errors = 0, replayed_errors = 0, differing = 0;
+  uint64_t bytes = 0;
+  char* buf = 0;
+  size_t bufsize = 0;
+  uint64_t start = now_ns();
+  struct trace_record record;
+  while(fread(&record,sizeof(record),1,trace) == 1){
+    if(fseeko(trace,(off_t)record.count*sizeof(struct trace_range),SEEK_CUR)){
+      perror("failed to read trace");
+      return 1;
+    }
+    if(count >= capacity){
+      capacity = capacity ? capacity * 2 : 1024;
+      recorded = realloc(recorded,capacity*sizeof(*recorded));
+      replayed = realloc(replayed,capacity*sizeof(*replayed));
+      if(!recorded || !replayed){
+        perror("realloc failed");
+        return 1;
+      }
+    }
+    if(record.size > bufsize){
+      free(buf);
+      bufsize = record.size;
+      buf = malloc(bufsize);
+      if(!buf){
+        perror("malloc failed");
+        return 1;
+      }
+    }
+    if(timed){
+      // Keep the gaps between the reads, but don't make up for slower ones
+      uint64_t now = now_ns();
+      if(start + record.time > now){
+        uint64_t wait = start + record.time - now;
+        nanosleep(&(struct timespec){wait / 1000000000, wait % 1000000000},0);
+      }
+    }
+    uint64_t t = now_ns();
+    ssize_t ret = pread(image,buf,record.size,record.offset);
+    replayed[count] = now_ns() - t;
+    recorded[count] = record.latency;
+    if(ret < 0){
+      replayed_errors++;
+      ret = -errno;
+    }else{
+      bytes += ret;
+    }
+    if(record.result < 0)
+      recorded_errors++;
+    if((ret < 0) != (record.result < 0))
+      differing++;
+    count++;
+  }
+  uint64_t total = now_ns() - start;
+
+  printf("reads:    %zu, %"PRIu64" bytes in %.3f s\n",count,bytes,total/1e9);
+  printf("errors:   %zu recorded, %zu replayed, %zu reads differ\n",recorded_errors,replayed_errors,differing);
+  print_latency("recorded:",recorded,count);
+  print_latency("replayed:",replayed,count);
+  free(recorded);
+  free(replayed);
+  free(buf);
+  close(image);
+  fclose(trace);
+  return 0;
+}
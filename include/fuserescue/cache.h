@@ -0,0 +1,55 @@
+/*
+fuserescue, an on demand data recovery tool which recovers data on a first access basis.
+Copyright (C) 2018 Daniel Abrecht
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <fuserescue/range.h>
+
+#define CACHE_BLOCK_SIZE 4096
+
+struct fuserescue;
+struct cache_entry;
+
+/*
+ * Keeps recently read blocks of the image in memory. Only blocks which are
+ * completely recovered are cached. Anything marking a part of the image as
+ * not recovered anymore has to invalidate it.
+ */
+struct block_cache {
+  pthread_mutex_t lock;
+  uint64_t size; // in bytes, 0 disables the cache
+  size_t count, buckets;
+  struct cache_entry** table;
+  struct cache_entry* lru; // most recently used entry, the least recently used one is before it
+  uint64_t generation; // incremented by every invalidation
+  uint64_t hits, misses;
+};
+
+void cache_init(struct block_cache* cache, uint64_t size);
+void cache_resize(struct block_cache* cache, uint64_t size);
+void cache_free(struct block_cache* cache);
+bool cache_enabled(struct block_cache* cache, uint64_t* generation);
+void cache_invalidate(struct block_cache* cache, uint64_t start, uint64_t end);
+void cache_write(struct fuserescue* fr, const char* buf, struct range r, uint64_t generation);
+void cache_read(struct fuserescue* fr, char* buf, struct range r, uint64_t generation);
+
+#endif
@@ -0,0 +1,28 @@
+/*
+fuserescue, an on demand data recovery tool which recovers data on a first access basis.
+Copyright (C) 2018 Daniel Abrecht
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <fuserescue/fuserescue.h>
+
+void fr_save_map(struct fuserescue* fr);
+void fr_checkpoint(struct fuserescue* fr);
+void* checkpoint_thread(void* param);
+
+#endif
@@ -0,0 +1,59 @@
+/*
+fuserescue, an on demand data recovery tool which recovers data on a first access basis.
+Copyright (C) 2018 Daniel Abrecht
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DEVICE_H
+#define DEVICE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+struct device_read {
+  uint64_t offset;
+  size_t size;
+  char* buf;
+  ssize_t result; // bytes read, or -1 if it failed
+  int error; // ETIMEDOUT if it took too long
+  unsigned source; // which source the result is from, see source_read
+};
+
+struct device;
+
+struct device_ops {
+  const char* name;
+  // Does all the reads, up to depth of them at the same time
+  void (*read)(struct device* dev, struct device_read* reads, size_t count);
+  void (*close)(struct device* dev);
+};
+
+struct device {
+  const struct device_ops* ops;
+  int fd;
+  unsigned depth; // how many reads may be in flight at once
+  uint64_t timeout; // in milliseconds, 0 for none
+  void* data;
+};
+
+void device_open_pread(struct device* dev, int fd);
+bool device_open_uring(struct device* dev, int fd, unsigned depth, uint64_t timeout);
+bool device_open_simulation(struct device* dev, int fd, const char* spec, unsigned sector_size, uint64_t timeout);
+void device_read(struct device* dev, struct device_read* reads, size_t count);
+void device_close(struct device* dev);
+
+#endif
@@ -25,32 +25,74 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <stdint.h>
 #include <stdbool.h>
 #include <pthread.h>
+#include <fuserescue/range.h>
+#include <fuserescue/device.h>
+#include <fuserescue/source.h>
+#include <fuserescue/cache.h>
+#include <fuserescue/stats.h>
+#include <fuserescue/trace.h>
 
-#define DIRECTIO_BUFFER_SIZE 1024 * 10
+#define BLOCKSIZE_MAX 0x1000000
+#define BUFFER_ALIGNMENT 4096
+#define QUEUE_DEPTH_MAX 64
+#define JOURNAL_COMPACT_SIZE 0x10000
+#define READAHEAD_PENDING_MAX 64
+#define SWEEP_SKIP_MAX 0x4000000
 
 enum loglevel {
   LOGLEVEL_DEFAULT,
   LOGLEVEL_INFO
 };
 
+struct fuse;
+
 struct fuserescue {
   pthread_mutex_t lock;
-  int infile, outfile;
-  const char* infile_path;
-  bool infile_directio;
-  uint64_t size, offset, blocksize;
+  pthread_mutex_t save_lock;
+  pthread_cond_t checkpoint_cond;
+  pthread_cond_t scheduler_cond;
+  pthread_cond_t completed_cond;
+  pthread_cond_t sweep_cond;
+  pthread_cond_t metadata_cond;
+  pthread_cond_t stale_cond;
+  struct recover_job* queue; // see scheduler.c
+  uint64_t head; // where the last read from the file to recover ended
+  int outfile;
+  bool writeback; // outfile isn't opened with O_SYNC, it's synced before the map is saved
+  struct source* source; // the infile first, then those added using --source
+  size_t source_count;
+  unsigned depth; // how many reads may be done at once, the most any source allows
+  uint64_t size, blocksize, sector_size;
+  bool adaptive;
+  uint64_t read_size; // current read size in adaptive mode, grows up to the blocksize
+  uint64_t readahead; // how much to recover after a demand read which had to recover something
+  bool sweep;
+  uint64_t sweep_pos; // where the sweep continues
+  size_t demand; // fuse reads in progress, the sweep waits for them
+  struct block_cache cache; // blocks of the image read recently
+  struct stats stats;
+  struct trace trace; // fuse reads are recorded here
+  bool kernel_cache; // the kernel may cache the image, see fr_read_buf
+  bool fuse_directio; // the kernel doesn't use the page cache for the image, short reads are fine
+  struct range_list stale; // ranges which aren't finished anymore, the kernel has to forget them
+  struct fuse* fuse; // set once fuse is initialized
+  pthread_t invalidator; // sends the stale ranges to the kernel
+  uint64_t deadline; // in milliseconds, how long a fuse read may wait for recovery, 0 for no limit
+  bool metadata_scan; // file system metadata is being searched and recovered
   struct mapfile* map;
   const char* mapfile;
   long unsigned recover_states;
   pthread_t self;
-  bool unsaved;
+  size_t unsaved; // map updates since the last checkpoint
+  uint64_t checkpoint_updates, checkpoint_interval;
+  bool exiting;
   bool allowed;
   enum loglevel loglevel;
 };
 
+bool fr_valid_blocksize(struct fuserescue* fr, uint64_t blocksize);
+
 extern const char license[];
 extern const size_t license_size;
 
-void fr_save_map(struct fuserescue* fr);
-
 #endif
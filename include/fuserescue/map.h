@@ -23,14 +23,15 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <stdint.h>
 #include <stdbool.h>
 
-#define ENTRIES_MAX 1024 * 1024 * 10
+#define MAP_OFFSET_MAX ((UINT64_C(1)<<60)-1)
 
 enum mapentry_state {
   ME_NON_TRIED,
   ME_NON_TRIMMED,
   ME_NON_SCRAPED,
   ME_BAD_SECTOR,
-  ME_FINISHED
+  ME_FINISHED,
+  ME_NONE // Not part of the mapfile, only used internally for gaps
 };
 
 enum mapfile_state {
@@ -48,17 +49,61 @@ struct mapentry {
   enum mapentry_state state;
 };
 
+#define MAP_DEPTH_MAX 16
+#define MAP_JOURNAL_MAGIC UINT64_C(0x6c6e72756f6a7266)
+
+struct map_node;
+
+struct map_journal_record {
+  uint64_t entry; // offset and state, packed the same way as in the map
+  uint64_t size;
+  uint64_t check;
+};
+
+// Updates which haven't been written to the mapfile yet are appended to mapfile.journal
+struct map_journal {
+  int fd;
+  size_t size; // records in the journal file
+  size_t count, capacity; // pending records, added by map_update
+  struct map_journal_record* pending;
+};
+
+/*
+ * The map is stored as an ordered set of boundaries in a B+tree.
+ * Each boundary has an offset and the state of everything from there
+ * up to the next boundary. The first boundary is never ME_NONE,
+ * the last one always is, and no two consecutive boundaries share
+ * the same state. Boundaries are packed into 64 bits each, which
+ * limits offsets to MAP_OFFSET_MAX. Nodes may be shared with clones
+ * of the map, they are copied before they change.
+ */
 struct mapfile {
   size_t total;
   enum mapfile_state state;
-  size_t count;
-  struct mapentry entries[ENTRIES_MAX];
+  size_t count; // number of boundaries
+  unsigned height;
+  struct map_node* root;
+  struct map_journal* journal;
+};
+
+struct map_iterator {
+  unsigned depth;
+  struct map_node* node[MAP_DEPTH_MAX];
+  unsigned index[MAP_DEPTH_MAX];
 };
 
 bool map_normalize(struct mapfile* map);
 struct mapfile* map_read(const char* file);
-bool map_move(struct mapfile* map, size_t i, ssize_t n);
+void map_free(struct mapfile* map);
 bool map_write(struct mapfile* map, int fd);
 void map_update(struct mapfile* map, uint64_t start, uint64_t end, enum mapentry_state state);
+enum mapentry_state map_state_at(struct mapfile* map, uint64_t offset);
+void map_iterate(struct mapfile* map, struct map_iterator* it, uint64_t offset);
+bool map_next(struct map_iterator* it, struct mapentry* entry);
+struct mapfile* map_clone(struct mapfile* map);
+bool map_journal_open(struct mapfile* map, const char* file);
+void map_journal_take(struct mapfile* map, struct map_journal_record** records, size_t* count);
+bool map_journal_append(struct map_journal* journal, const struct map_journal_record* records, size_t count);
+bool map_journal_reset(struct map_journal* journal, const char* file);
 
 #endif
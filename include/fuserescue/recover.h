@@ -0,0 +1,33 @@
+/*
+fuserescue, an on demand data recovery tool which recovers data on a first access basis.
+Copyright (C) 2018 Daniel Abrecht
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef RECOVER_H
+#define RECOVER_H
+
+#include <fuserescue/fuserescue.h>
+#include <fuserescue/range.h>
+
+bool classify_range(struct fuserescue* fr, uint64_t start, uint64_t end, struct range_list* finished, struct range_list* to_recover);
+void read_image(struct fuserescue* fr, char* buf, uint64_t start, uint64_t end);
+size_t recover_buffer_size(struct fuserescue* fr, uint64_t blocksize);
+bool recover_range(struct fuserescue* fr, char* readbuffer, struct range r, uint64_t blocksize);
+bool recover_slice(struct fuserescue* fr, char* readbuffer, struct range r, const char* what);
+void fr_readahead(struct fuserescue* fr, uint64_t start);
+void* sweep_thread(void* param);
+
+#endif
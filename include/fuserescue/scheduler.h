@@ -0,0 +1,48 @@
+/*
+fuserescue, an on demand data recovery tool which recovers data on a first access basis.
+Copyright (C) 2018 Daniel Abrecht
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <fuserescue/fuserescue.h>
+#include <fuserescue/range.h>
+#include <time.h>
+
+enum recover_priority {
+  PRIORITY_DEMAND,
+  PRIORITY_METADATA,
+  PRIORITY_READAHEAD,
+  PRIORITY_SWEEP,
+  PRIORITY_COUNT
+};
+
+struct recover_job {
+  struct recover_job* next;
+  struct range range; // what's left to recover
+  enum recover_priority priority;
+  bool detached; // nobody waits for it, the scheduler frees it when it's done
+  bool running, done, ok;
+};
+
+struct recover_job* scheduler_submit(struct fuserescue* fr, struct range r, enum recover_priority priority, bool wait);
+bool scheduler_wait(struct fuserescue* fr, struct recover_job* job);
+bool scheduler_wait_until(struct fuserescue* fr, struct recover_job* job, const struct timespec* deadline);
+bool scheduler_recover(struct fuserescue* fr, struct range r, enum recover_priority priority);
+void* scheduler_thread(void* param);
+
+#endif
@@ -0,0 +1,58 @@
+/*
+fuserescue, an on demand data recovery tool which recovers data on a first access basis.
+Copyright (C) 2018 Daniel Abrecht
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef SOURCE_H
+#define SOURCE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <fuserescue/device.h>
+
+#define SOURCES_MAX 16
+
+struct fuserescue;
+struct mapfile;
+
+/*
+ * Something holding the data to recover. The infile is always the first source, more
+ * can be added using --source, like the other disk of a mirror, or the image of an
+ * earlier attempt together with its mapfile. A read which fails on one source is tried
+ * on the next one, see source_read.
+ */
+struct source {
+  char* path;
+  int fd;
+  uint64_t offset;
+  bool directio;
+  struct device device;
+  struct mapfile* map; // if set, only what's finished in it is read from this source
+  struct mapfile* recovered; // what was recovered from this source, only kept if there are several
+  uint64_t head; // where the last read from this source ended
+  // Health, only changed by the thread reading the sources
+  uint64_t reads, failures, bytes, busy_ns;
+};
+
+bool source_parse(struct source* source, const char* spec);
+bool source_open(struct source* source);
+bool source_reopen(struct fuserescue* fr, struct source* source, const char* path);
+void source_read(struct fuserescue* fr, struct device_read* reads, size_t count);
+char* source_mapfile(const char* mapfile, size_t index);
+void source_close(struct source* source);
+
+#endif
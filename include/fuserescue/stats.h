@@ -0,0 +1,79 @@
+/*
+fuserescue, an on demand data recovery tool which recovers data on a first access basis.
+Copyright (C) 2018 Daniel Abrecht
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <fuserescue/map.h>
+
+#define STATS_BUCKETS 24 // bucket i counts durations below 2^i microseconds, the last one everything else
+#define STATS_SIZE_MIN_LOG2 9 // device reads are grouped by size, from 512 bytes
+#define STATS_SIZES 16 // up to BLOCKSIZE_MAX
+
+struct fuserescue;
+
+enum stats_format {
+  STATS_TEXT,
+  STATS_JSON,
+  STATS_PROMETHEUS
+};
+
+struct histogram {
+  uint64_t count;
+  uint64_t sum; // in nanoseconds
+  uint64_t bucket[STATS_BUCKETS];
+};
+
+/*
+ * Everything is updated with relaxed atomics, so it can be done on the hot
+ * path without taking another lock. Readers may see slightly inconsistent values.
+ */
+struct stats {
+  uint64_t reads; // fuse reads of the image
+  uint64_t bytes_served;
+  uint64_t bytes_recovered; // written to the image
+  uint64_t eio[ME_NONE+1]; // failed fuse reads, by the state of the first part which wasn't recovered
+  uint64_t readahead_rejected; // reads failed right away with --kernel-cache
+  uint64_t seeks; // device reads which didn't start where the previous one from the same source ended
+  struct histogram device_read[STATS_SIZES];
+  struct histogram map_lookup;
+  struct histogram save;
+  struct histogram lock_wait;
+  // Periodic dump, see stats_thread
+  const char* file;
+  enum stats_format format;
+  uint64_t interval; // in seconds
+  pthread_cond_t cond;
+};
+
+uint64_t stats_now(void);
+void stats_add(uint64_t* counter, uint64_t n);
+void stats_record(struct histogram* h, uint64_t ns);
+void stats_time(struct histogram* h, uint64_t start);
+void stats_device_read(struct stats* stats, uint64_t size, uint64_t start);
+void stats_reset(struct stats* stats);
+bool stats_parse_format(const char* name, enum stats_format* format);
+void stats_print(struct stats* stats, FILE* f, enum stats_format format);
+void fr_lock(struct fuserescue* fr);
+void* stats_thread(void* param);
+
+#endif
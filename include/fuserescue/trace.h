@@ -0,0 +1,79 @@
+/*
+fuserescue, an on demand data recovery tool which recovers data on a first access basis.
+Copyright (C) 2018 Daniel Abrecht
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <fuserescue/range.h>
+
+#define TRACE_MAGIC UINT64_C(0x6563617274727266)
+#define TRACE_VERSION 1
+#define TRACE_KIND_SHIFT 60
+
+/*
+ * A trace file starts with a trace_header, followed by a trace_record for every fuse read.
+ * Each record is followed by its trace_range entries. All numbers are in host byte order.
+ */
+struct trace_header {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t reserved;
+};
+
+struct trace_record {
+  uint64_t time; // in nanoseconds since the trace was started
+  uint64_t latency; // in nanoseconds
+  uint64_t offset;
+  uint32_t size;
+  int32_t result; // bytes returned or -errno
+  uint32_t count; // trace_range entries following this record
+  uint32_t reserved;
+};
+
+enum trace_kind {
+  TRACE_FINISHED, // was already recovered
+  TRACE_TO_RECOVER, // had to be recovered
+  TRACE_FAILED // couldn't be recovered
+};
+
+struct trace_range {
+  uint64_t start; // the trace_kind is in the top 4 bits
+  uint64_t end;
+};
+
+struct trace {
+  pthread_mutex_t lock;
+  FILE* file; // 0 if nothing is traced
+  uint64_t start;
+};
+
+bool trace_open(struct trace* trace, const char* path);
+void trace_read(
+  struct trace* trace,
+  uint64_t start, uint64_t offset, uint32_t size, int32_t result,
+  const struct range_list* finished,
+  const struct range_list* to_recover,
+  const struct range_list* failed
+);
+void trace_close(struct trace* trace);
+
+#endif
@@ -29,6 +29,7 @@ struct pager {
 };
 
 bool parseu64(const char** str, uint64_t* ret);
+bool parse_option(const char** s, const char* name, uint64_t* value);
 int u64toa(uint64_t x, char r[18]);
 void skip_spaces(const char** x);
 struct pager pager_create(const char** commands, bool shell);
@@ -0,0 +1,229 @@
+/*
+fuserescue, an on demand data recovery tool which recovers data on a first access basis.
+Copyright (C) 2018 Daniel Abrecht
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <fuserescue/fuserescue.h>
+#include <fuserescue/cache.h>
+#include <fuserescue/recover.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct cache_entry {
+  struct cache_entry* hash_next;
+  struct cache_entry *prev, *next; // in the lru list, which is circular
+  uint64_t block;
+  size_t size;
+  char data[];
+};
+
+static inline size_t bucket_of(const struct block_cache* cache, uint64_t block){
+  return (block * UINT64_C(0x9E3779B97F4A7C15)) >> 32 & (cache->buckets - 1);
+}
+
+static struct cache_entry* entry_find(struct block_cache* cache, uint64_t block){
+  if(!cache->buckets)
+    return 0;
+  struct cache_entry* entry = cache->table[bucket_of(cache,block)];
+  while(entry && entry->block != block)
+    entry = entry->hash_next;
+  return entry;
+}
+
+static void lru_unlink(struct block_cache* cache, struct cache_entry* entry){
+  if(entry->next == entry){
+    cache->lru = 0;
+  }else{
+    entry->prev->next = entry->next;
+    entry->next->prev = entry->prev;
+    if(cache->lru == entry)
+      cache->lru = entry->next;
+  }
+}
+
+static void lru_push(struct block_cache* cache, struct cache_entry* entry){
+  if(!cache->lru){
+    entry->prev = entry->next = entry;
+  }else{
+    entry->next = cache->lru;
+    entry->prev = cache->lru->prev;
+    entry->prev->next = entry;
+    entry->next->prev = entry;
+  }
+  cache->lru = entry;
+}
+
+static void entry_remove(struct block_cache* cache, struct cache_entry* entry){
+  struct cache_entry** it = &cache->table[bucket_of(cache,entry->block)];
+  while(*it != entry)
+    it = &(*it)->hash_next;
+  *it = entry->hash_next;
+  lru_unlink(cache,entry);
+  cache->count--;
+  free(entry);
+}
+
+static void clear(struct block_cache* cache){
+  while(cache->lru)
+    entry_remove(cache,cache->lru);
+}
+
+// Returns whether the block was cached, in which case [offset, offset+size) of it was copied to buf
+static bool cache_get(struct block_cache* cache, uint64_t block, char* buf, size_t offset, size_t size){
+  pthread_mutex_lock(&cache->lock);
+  struct cache_entry* entry = entry_find(cache,block);
+  if(entry){
+    memcpy(buf,entry->data+offset,size);
+    lru_unlink(cache,entry);
+    lru_push(cache,entry);
+    cache->hits++;
+  }else{
+    cache->misses++;
+  }
+  pthread_mutex_unlock(&cache->lock);
+  return entry;
+}
+
+// Adds a block unless it was invalidated since generation was taken
+static void cache_put(struct block_cache* cache, uint64_t block, const char* data, size_t size, uint64_t generation){
+  pthread_mutex_lock(&cache->lock);
+  size_t max = cache->size / CACHE_BLOCK_SIZE;
+  if(!max || generation != cache->generation || entry_find(cache,block))
+    goto end;
+  struct cache_entry* entry = malloc(sizeof(*entry)+size);
+  if(!entry)
+    goto end;
+  while(cache->count >= max)
+    entry_remove(cache,cache->lru->prev);
+  entry->block = block;
+  entry->size = size;
+  memcpy(entry->data,data,size);
+  size_t i = bucket_of(cache,block);
+  entry->hash_next = cache->table[i];
+  cache->table[i] = entry;
+  lru_push(cache,entry);
+  cache->count++;
+end:
+  pthread_mutex_unlock(&cache->lock);
+}
+
+void cache_init(struct block_cache* cache, uint64_t size){
+  pthread_mutex_init(&cache->lock,0);
+  cache_resize(cache,size);
+}
+
+// Changes the size of the cache, which drops everything cached so far
+void cache_resize(struct block_cache* cache, uint64_t size){
+  size_t buckets = 0;
+  if(size >= CACHE_BLOCK_SIZE)
+    for(buckets=1; buckets < size / CACHE_BLOCK_SIZE; buckets *= 2);
+  struct cache_entry** table = buckets ? calloc(buckets,sizeof(*table)) : 0;
+  if(buckets && !table){
+    perror("failed to allocate cache");
+    exit(4);
+  }
+  pthread_mutex_lock(&cache->lock);
+  clear(cache);
+  free(cache->table);
+  cache->table = table;
+  cache->buckets = buckets;
+  cache->size = size;
+  cache->generation++;
+  pthread_mutex_unlock(&cache->lock);
+}
+
+void cache_free(struct block_cache* cache){
+  cache_resize(cache,0);
+  pthread_mutex_destroy(&cache->lock);
+}
+
+/*
+ * Returns whether the cache is used. The generation has to be taken
+ * while the part of the image to be read is known to be recovered.
+ */
+bool cache_enabled(struct block_cache* cache, uint64_t* generation){
+  pthread_mutex_lock(&cache->lock);
+  bool enabled = cache->size >= CACHE_BLOCK_SIZE;
+  *generation = cache->generation;
+  pthread_mutex_unlock(&cache->lock);
+  return enabled;
+}
+
+// Drops all cached blocks overlapping [start, end)
+void cache_invalidate(struct block_cache* cache, uint64_t start, uint64_t end){
+  if(start >= end)
+    return;
+  pthread_mutex_lock(&cache->lock);
+  cache->generation++;
+  uint64_t first = start / CACHE_BLOCK_SIZE;
+  uint64_t last = (end - 1) / CACHE_BLOCK_SIZE;
+  if(last - first < cache->count){
+    for(uint64_t block=first; block<=last; block++){
+      struct cache_entry* entry = entry_find(cache,block);
+      if(entry)
+        entry_remove(cache,entry);
+    }
+  }else if(cache->lru){
+    struct cache_entry* entry = cache->lru->prev;
+    for(size_t n=cache->count; n--; ){
+      struct cache_entry* prev = entry->prev;
+      if(entry->block >= first && entry->block <= last)
+        entry_remove(cache,entry);
+      entry = prev;
+    }
+  }
+  pthread_mutex_unlock(&cache->lock);
+}
+
+/*
+ * Caches the blocks completely within r, whose data is in buf. The last block of the
+ * image counts as complete if r reaches the end of the image.
+ */
+void cache_write(struct fuserescue* fr, const char* buf, struct range r, uint64_t generation){
+  uint64_t b = (r.start + CACHE_BLOCK_SIZE - 1) / CACHE_BLOCK_SIZE;
+  for(; (b + 1) * CACHE_BLOCK_SIZE <= r.end || (b * CACHE_BLOCK_SIZE < r.end && r.end == fr->size); b++){
+    uint64_t bstart = b * CACHE_BLOCK_SIZE;
+    uint64_t bend = bstart + CACHE_BLOCK_SIZE < r.end ? bstart + CACHE_BLOCK_SIZE : r.end;
+    cache_put(&fr->cache,b,buf+(bstart-r.start),bend-bstart,generation);
+  }
+}
+
+/*
+ * Reads r, which has to be recovered, from the image into buf. Blocks which aren't cached
+ * are read from the outfile together, those completely within r are cached afterwards.
+ */
+void cache_read(struct fuserescue* fr, char* buf, struct range r, uint64_t generation){
+  struct block_cache* cache = &fr->cache;
+  uint64_t pos = r.start;
+  uint64_t miss = r.start; // start of the blocks which still have to be read from the outfile
+  while(miss < r.end){
+    uint64_t block = pos / CACHE_BLOCK_SIZE;
+    uint64_t end = (block + 1) * CACHE_BLOCK_SIZE;
+    if(end > r.end)
+      end = r.end;
+    if(pos < r.end && !cache_get(cache,block,buf+(pos-r.start),pos%CACHE_BLOCK_SIZE,end-pos)){
+      pos = end;
+      continue;
+    }
+    if(miss < pos){
+      read_image(fr,buf+(miss-r.start),miss,pos);
+      cache_write(fr,buf+(miss-r.start),(struct range){miss,pos},generation);
+    }
+    pos = end;
+    miss = end;
+  }
+}
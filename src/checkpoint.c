@@ -0,0 +1,185 @@
+/*
+fuserescue, an on demand data recovery tool which recovers data on a first access basis.
+Copyright (C) 2018 Daniel Abrecht
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <fuserescue/fuserescue.h>
+#include <fuserescue/checkpoint.h>
+#include <fuserescue/map.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+
+// Writes a map to a temporary file and replaces the mapfile with it
+static void write_map(struct mapfile* map, const char* mapfile){
+  if(!map_normalize(map)){
+    printf("Bug: map became corrupted!!!\n");
+    map_write(map,1); // write it to stdout
+    exit(5);
+  }
+  char tmpfile[strlen(mapfile)+sizeof(".tmp")];
+  sprintf(tmpfile,"%s.tmp",mapfile);
+  int mapfd = open(tmpfile,O_CREAT|O_WRONLY|O_TRUNC|O_BINARY,0660);
+  if(mapfd==-1){
+    perror("failed to open mapfile");
+    exit(5);
+  }
+  if(!map_write(map,mapfd) || fsync(mapfd)){
+    perror("failed to write mapfile");
+    exit(5);
+  }
+  close(mapfd);
+  if(rename(tmpfile,mapfile)){
+    perror("failed to replace mapfile");
+    exit(5);
+  }
+}
+
+/*
+ * Persists all map changes made so far. Only taking a snapshot of the map or
+ * the pending journal records happens while holding fr->lock, everything else
+ * happens without it. fr->save_lock serializes concurrent saves.
+ */
+static void save_map(struct fuserescue* fr, bool full){
+  pthread_mutex_lock(&fr->save_lock);
+  uint64_t start = stats_now();
+  fr_lock(fr);
+  struct map_journal* journal = fr->map->journal;
+  struct map_journal_record* records = 0;
+  size_t count = 0;
+  if(journal){
+    if(journal->size + journal->count >= JOURNAL_COMPACT_SIZE)
+      full = true;
+    map_journal_take(fr->map,&records,&count);
+  }else{
+    full = true;
+  }
+  struct mapfile* snapshot = 0;
+  struct mapfile* recovered[SOURCES_MAX];
+  size_t sources = 0;
+  char* mapfile = 0;
+  if(full){
+    snapshot = map_clone(fr->map);
+    if(fr->source_count > 1)
+      for(; sources<fr->source_count; sources++)
+        recovered[sources] = map_clone(fr->source[sources].recovered);
+    mapfile = strdup(fr->mapfile);
+    if(!mapfile){
+      perror("strdup failed");
+      exit(5);
+    }
+  }
+  bool writeback = fr->writeback;
+  fr->unsaved = 0;
+  pthread_mutex_unlock(&fr->lock);
+
+  // Everything in the snapshot has been written to the image, make sure it's there before the map says so
+  if(writeback && fdatasync(fr->outfile)){
+    perror("failed to sync output file");
+    exit(2);
+  }
+
+  if(full){
+    write_map(snapshot,mapfile);
+    if(!map_journal_reset(journal,mapfile)){
+      perror("failed to reset journal");
+      exit(5);
+    }
+    map_free(snapshot);
+    // Which source what came from isn't journaled, it's only saved along with the whole map
+    for(size_t i=0; i<sources; i++){
+      char* path = source_mapfile(mapfile,i);
+      write_map(recovered[i],path);
+      map_free(recovered[i]);
+      free(path);
+    }
+    free(mapfile);
+  }else if(!map_journal_append(journal,records,count)){
+    perror("failed to write journal");
+    exit(5);
+  }
+  free(records);
+  stats_time(&fr->stats.save,start);
+  pthread_mutex_unlock(&fr->save_lock);
+}
+
+void fr_save_map(struct fuserescue* fr){
+  save_map(fr,true);
+}
+
+// Persists the map changes, either by appending them to the journal or by saving the whole map
+void fr_checkpoint(struct fuserescue* fr){
+  save_map(fr,false);
+}
+
+static uint64_t now_ms(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Saves the map once checkpoint_updates map updates accumulated, or once
+ * checkpoint_interval seconds passed since the last checkpoint. Updates
+ * made while a checkpoint is being written are saved together by the next one.
+ */
+void* checkpoint_thread(void* param){
+  struct fuserescue* fr = param;
+  uint64_t last = now_ms();
+  fr_lock(fr);
+  while(!fr->exiting){
+    uint64_t interval = fr->checkpoint_interval * 1000;
+    uint64_t now = now_ms();
+    bool due = fr->unsaved && (
+        (fr->checkpoint_updates && fr->unsaved >= fr->checkpoint_updates)
+     || (interval && now - last >= interval)
+    );
+    if(!due){
+      if(fr->unsaved && interval){
+        uint64_t deadline = last + interval;
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC,&ts);
+        ts.tv_sec += (deadline - now) / 1000;
+        ts.tv_nsec += (deadline - now) % 1000 * 1000000;
+        if(ts.tv_nsec >= 1000000000){
+          ts.tv_sec++;
+          ts.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&fr->checkpoint_cond,&fr->lock,&ts);
+      }else{
+        pthread_cond_wait(&fr->checkpoint_cond,&fr->lock);
+      }
+      continue;
+    }
+    pthread_mutex_unlock(&fr->lock);
+    fr_checkpoint(fr);
+    last = now_ms();
+    fr_lock(fr);
+  }
+  pthread_mutex_unlock(&fr->lock);
+  return 0;
+}
@@ -20,6 +20,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <fuserescue/utils.h>
 #include <fuserescue/cmd.h>
 #include <fuserescue/map.h>
+#include <fuserescue/checkpoint.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -36,32 +37,63 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #endif
 
 static int cmd_reopen(struct fuserescue* fr, int argc, char* argv[argc]){
-  if(argc > 2){
-    printf("usage: %s [infile]",argv[0]);
-    return 1;
-  }
-  const char* path = argc < 2 ? fr->infile_path : argv[1];
-  int infile;
-  {
-    int flags = O_RDONLY | O_BINARY;
-    if(fr->infile_directio)
-      flags |= O_DIRECT;
-    infile = open( path, flags );
-  }
-  if(infile == -1){
+  size_t index = 0;
+  const char* path = 0;
+  if(argc >= 3 && !strcmp(argv[1],"source")){
+    const char* s = argv[2];
+    uint64_t n;
+    if(argc > 4 || !parseu64(&s,&n) || *s || n >= fr->source_count)
+      goto usage;
+    index = n;
+    path = argc > 3 ? argv[3] : 0;
+  }else if(argc <= 2){
+    path = argc > 1 ? argv[1] : 0;
+  }else goto usage;
+  if(!source_reopen(fr,&fr->source[index],path)){
     perror("Failed to open file");
     return 2;
   }
-  if(dup2(infile,fr->infile)<0){
-    perror("dup2 failed");
-    close(infile);
-    return 2;
-  }
-  close(infile);
-  fr->infile_path = path;
+  cache_invalidate(&fr->cache,0,UINT64_MAX);
   return 0;
+usage:
+  printf("usage: %s [infile]\n       %s source number [file]\n",argv[0],argv[0]);
+  return 1;
 }
 
+static int cmd_sources(struct fuserescue* fr, int argc, char* argv[argc]){
+  (void)argc;
+  (void)argv;
+  for(size_t i=0; i<fr->source_count; i++){
+    struct source* source = &fr->source[i];
+    uint64_t reads = __atomic_load_n(&source->reads,__ATOMIC_RELAXED);
+    uint64_t failures = __atomic_load_n(&source->failures,__ATOMIC_RELAXED);
+    uint64_t bytes = __atomic_load_n(&source->bytes,__ATOMIC_RELAXED);
+    uint64_t busy = __atomic_load_n(&source->busy_ns,__ATOMIC_RELAXED);
+    fr_lock(fr);
+    char* path = strdup(source->path);
+    pthread_mutex_unlock(&fr->lock);
+    printf("%zu: %s, offset %"PRIu64"%s%s\n",i,path?path:"?",source->offset,
+      source->directio ? "" : ", no direct io", source->map ? ", only what its map has finished" : "");
+    free(path);
+    printf("   %"PRIu64" reads, %"PRIu64" failed, %"PRIu64" bytes read",reads,failures,bytes);
+    if(busy)
+      printf(" at %.1f MiB/s",bytes / 1048576.0 / (busy / 1e9));
+    if(source->recovered){
+      uint64_t recovered = 0;
+      struct map_iterator it;
+      struct mapentry entry;
+      fr_lock(fr);
+      map_iterate(source->recovered,&it,0);
+      while(map_next(&it,&entry))
+        if(entry.state == ME_FINISHED)
+          recovered += entry.size;
+      pthread_mutex_unlock(&fr->lock);
+      printf(", %"PRIu64" bytes of the image are from it",recovered);
+    }
+    putchar('\n');
+  }
+  return 0;
+}
 
 static int cmd_save(struct fuserescue* fr, int argc, char* argv[argc]){
   if(argc > 2){
@@ -69,14 +101,47 @@ static int cmd_save(struct fuserescue* fr, int argc, char* argv[argc]){
     return 1;
   }
   if(argc >= 2){
+    fr_lock(fr);
     if(fr->mapfile)
       free((void*)fr->mapfile);
     fr->mapfile = strdup(argv[1]);
+    pthread_mutex_unlock(&fr->lock);
   }
   fr_save_map(fr);
   return 0;
 }
 
+static int cmd_checkpoint(struct fuserescue* fr, int argc, char* argv[argc]){
+  if(argc != 1 && argc != 3)
+    goto usage;
+  fr_lock(fr);
+  if(argc == 3){
+    uint64_t value;
+    const char* s = argv[2];
+    if(!parseu64(&s,&value) || *s){
+      pthread_mutex_unlock(&fr->lock);
+      goto usage;
+    }
+    if(!strcmp(argv[1],"updates")){
+      fr->checkpoint_updates = value;
+    }else if(!strcmp(argv[1],"interval")){
+      fr->checkpoint_interval = value;
+    }else{
+      pthread_mutex_unlock(&fr->lock);
+      goto usage;
+    }
+    pthread_cond_signal(&fr->checkpoint_cond);
+  }
+  printf("checkpoint updates = %"PRIu64"\n",fr->checkpoint_updates);
+  printf("checkpoint interval = %"PRIu64"\n",fr->checkpoint_interval);
+  printf("unsaved updates = %zu\n",fr->unsaved);
+  pthread_mutex_unlock(&fr->lock);
+  return 0;
+usage:
+  printf("usage: %s [updates|interval number]\n",argv[0]);
+  return 1;
+}
+
 static int cmd_exit(struct fuserescue* fr, int argc, char* argv[argc]){
   (void)argc;
   (void)argv;
@@ -89,15 +154,13 @@ static int cmd_blocksize(struct fuserescue* fr, int argc, char* argv[argc]){
     printf("usage: %s [size]",argv[0]);
     return 1;
   }
-  pthread_mutex_lock(&fr->lock);
+  fr_lock(fr);
   if(argc == 2){
     uint64_t size;
     const char* s = argv[1];
     if(!parseu64(&s,&size)){
       perror("Failed to parse size");
-    }else if(size > (uint64_t)DIRECTIO_BUFFER_SIZE){
-      fprintf(stderr,"Blocksize too big, can't be bigger than %d\n",DIRECTIO_BUFFER_SIZE);
-    }else{
+    }else if(fr_valid_blocksize(fr,size)){
       fr->blocksize = size;
     }
   }
@@ -106,6 +169,153 @@ static int cmd_blocksize(struct fuserescue* fr, int argc, char* argv[argc]){
   return 0;
 }
 
+static int cmd_deadline(struct fuserescue* fr, int argc, char* argv[argc]){
+  if(argc > 2){
+    printf("usage: %s [ms]\n",argv[0]);
+    return 1;
+  }
+  fr_lock(fr);
+  if(argc == 2){
+    uint64_t ms;
+    const char* s = argv[1];
+    if(!parseu64(&s,&ms) || *s){
+      fprintf(stderr,"Failed to parse deadline\n");
+    }else{
+      fr->deadline = ms;
+    }
+  }
+  printf("deadline = %"PRIu64" ms\n",fr->deadline);
+  pthread_mutex_unlock(&fr->lock);
+  return 0;
+}
+
+static int cmd_cache(struct fuserescue* fr, int argc, char* argv[argc]){
+  if(argc > 2){
+    printf("usage: %s [size]\n",argv[0]);
+    return 1;
+  }
+  struct block_cache* cache = &fr->cache;
+  if(argc == 2){
+    uint64_t size;
+    const char* s = argv[1];
+    if(!parseu64(&s,&size) || *s){
+      fprintf(stderr,"Failed to parse size\n");
+    }else{
+      cache_resize(cache,size);
+    }
+  }
+  pthread_mutex_lock(&cache->lock);
+  printf("cache = %"PRIu64" (%zu blocks cached, %"PRIu64" hits, %"PRIu64" misses)\n",cache->size,cache->count,cache->hits,cache->misses);
+  pthread_mutex_unlock(&cache->lock);
+  return 0;
+}
+
+static int cmd_stats(struct fuserescue* fr, int argc, char* argv[argc]){
+  struct stats* stats = &fr->stats;
+  enum stats_format format = STATS_TEXT;
+  if(argc == 2 && !strcmp(argv[1],"reset")){
+    stats_reset(stats);
+    return 0;
+  }
+  if(argc >= 3 && !strcmp(argv[1],"dump")){
+    uint64_t interval = stats->interval;
+    if(argc >= 4){
+      const char* s = argv[3];
+      if(!parseu64(&s,&interval) || *s)
+        goto usage;
+    }
+    format = stats->format;
+    if(argc == 5 && !stats_parse_format(argv[4],&format))
+      goto usage;
+    if(argc > 5)
+      goto usage;
+    char* file = strdup(argv[2]);
+    if(!file){
+      perror("strdup failed");
+      return 1;
+    }
+    fr_lock(fr);
+    free((void*)stats->file);
+    stats->file = file;
+    stats->interval = interval;
+    stats->format = format;
+    pthread_cond_signal(&stats->cond);
+    pthread_mutex_unlock(&fr->lock);
+    return 0;
+  }
+  if(argc > 2 || (argc == 2 && !stats_parse_format(argv[1],&format)))
+    goto usage;
+  stats_print(stats,stdout,format);
+  return 0;
+usage:
+  printf("usage: %s [text|json|prometheus|reset|dump file [seconds [format]]]\n",argv[0]);
+  return 1;
+}
+
+static int cmd_readahead(struct fuserescue* fr, int argc, char* argv[argc]){
+  if(argc > 2){
+    printf("usage: %s [size]\n",argv[0]);
+    return 1;
+  }
+  fr_lock(fr);
+  if(argc == 2){
+    uint64_t size;
+    const char* s = argv[1];
+    if(!parseu64(&s,&size) || *s){
+      fprintf(stderr,"Failed to parse size\n");
+    }else{
+      fr->readahead = size;
+    }
+  }
+  printf("readahead = %"PRIu64"\n",fr->readahead);
+  pthread_mutex_unlock(&fr->lock);
+  return 0;
+}
+
+static int cmd_metadata(struct fuserescue* fr, int argc, char* argv[argc]){
+  (void)argc;
+  (void)argv;
+  fr_lock(fr);
+  if(fr->metadata_scan){
+    puts("metadata is already being recovered");
+  }else{
+    fr->metadata_scan = true;
+    pthread_cond_signal(&fr->metadata_cond);
+  }
+  pthread_mutex_unlock(&fr->lock);
+  return 0;
+}
+
+static int cmd_sweep(struct fuserescue* fr, int argc, char* argv[argc]){
+  if(argc > 2 || (argc == 2 && strcmp(argv[1],"on") && strcmp(argv[1],"off"))){
+    printf("usage: %s [on|off]\n",argv[0]);
+    return 1;
+  }
+  fr_lock(fr);
+  if(argc == 2){
+    fr->sweep = !strcmp(argv[1],"on");
+    pthread_cond_signal(&fr->sweep_cond);
+  }
+  printf("sweep = %s, position = 0x%"PRIx64"\n",fr->sweep?"on":"off",fr->sweep_pos);
+  pthread_mutex_unlock(&fr->lock);
+  return 0;
+}
+
+static int cmd_adaptive(struct fuserescue* fr, int argc, char* argv[argc]){
+  if(argc > 2 || (argc == 2 && strcmp(argv[1],"on") && strcmp(argv[1],"off"))){
+    printf("usage: %s [on|off]\n",argv[0]);
+    return 1;
+  }
+  fr_lock(fr);
+  if(argc == 2){
+    fr->adaptive = !strcmp(argv[1],"on");
+    fr->read_size = 0;
+  }
+  printf("adaptive = %s\n",fr->adaptive?"on":"off");
+  pthread_mutex_unlock(&fr->lock);
+  return 0;
+}
+
 static int cmd_recovery(struct fuserescue* fr, int argc, char* argv[argc]){
   if(argc < 2 || !(!strcmp(argv[1],"allow")||!strcmp(argv[1],"denay")||!strcmp(argv[1],"show"))){
     printf("usage: %s allow|denay|show [nontried|nontrimed|nonscraped|badsector]\n",argv[0]);
@@ -118,7 +328,7 @@ static int cmd_recovery(struct fuserescue* fr, int argc, char* argv[argc]){
   if(!strcmp(argv[1],"show"))
     goto show;
 
-  pthread_mutex_lock(&fr->lock);
+  fr_lock(fr);
   bool allow = !strcmp(argv[1],"allow");
   if(argc==2){
     fr->allowed = allow;
@@ -141,10 +351,11 @@ static int cmd_recovery(struct fuserescue* fr, int argc, char* argv[argc]){
       fr->recover_states &= ~mask;
     }
   }
+  pthread_cond_signal(&fr->sweep_cond);
   pthread_mutex_unlock(&fr->lock);
 
   show: {
-    pthread_mutex_lock(&fr->lock);
+    fr_lock(fr);
     puts(fr->allowed ? "recovery mode: allow" : "recovery mode: denay");
     printf("sections to recover: ");
     if((1<<ME_NON_TRIED) & fr->recover_states)
@@ -193,11 +404,14 @@ static int cmd_show(struct fuserescue* fr, int argc, char* argv[argc]){
     goto usage;
 
   if(!strcmp("map",argv[1])){
-    struct pager pager = pager_create(0,false);
-    pthread_mutex_lock(&fr->lock);
-    map_write(fr->map,pager.input);
+    // The pager may take its time, don't keep the map locked meanwhile
+    fr_lock(fr);
+    struct mapfile* snapshot = map_clone(fr->map);
     pthread_mutex_unlock(&fr->lock);
+    struct pager pager = pager_create(0,false);
+    map_write(snapshot,pager.input);
     pager_close_wait(&pager);
+    map_free(snapshot);
   }else if(!strcmp("license",argv[1])){
     struct pager pager = pager_create(0,false);
     write(pager.input,license,license_size);
@@ -242,9 +456,18 @@ static struct commands command_list[] = {
   {"exit",cmd_exit,"Exits the program"},
   {"recovery",cmd_recovery,"Allow reading from device to backup. Arguments: allow|denay|show [nontried|nontrimed|nonscraped|badsector]"},
   {"show",cmd_show,"You can display the following:\n\tmap: the mapfile.\n\tlicense: the license\n\treadme: The readme file"},
-  {"reopen",cmd_reopen,"Reopen the file to recover. You can optionally specify the file if it changed location"},
+  {"reopen",cmd_reopen,"Reopen the file to recover, or with source and its number, another source. You can optionally specify the file if it changed location"},
+  {"sources",cmd_sources,"Show the sources, how their reads went, and how much of the image is from each of them."},
   {"blocksize",cmd_blocksize,"Get or set biggest unit of data tried to recover at once."},
-  {"loglevel",cmd_loglevel,"Get or set loglevel\n"}
+  {"adaptive",cmd_adaptive,"Get or set whether the read size adapts to how well reads succeed, failed reads are bisected."},
+  {"metadata",cmd_metadata,"Find partition tables and file systems and recover their metadata in the background."},
+  {"sweep",cmd_sweep,"Get or set whether nontried areas are recovered in the background while nothing is read."},
+  {"deadline",cmd_deadline,"Get or set how many milliseconds a read of the image waits for recovery before answering with what's there. 0 means no limit."},
+  {"cache",cmd_cache,"Get or set how many bytes of recently read blocks of the image are kept in memory. 0 disables it."},
+  {"stats",cmd_stats,"Show statistics, reset them, or write them to a file every few seconds."},
+  {"readahead",cmd_readahead,"Get or set how much is recovered in the background after a read which had to recover something. 0 disables it."},
+  {"loglevel",cmd_loglevel,"Get or set loglevel\n"},
+  {"checkpoint",cmd_checkpoint,"Get or set after how many map updates or seconds the map is saved in the background. 0 disables either."}
 };
 static size_t command_count = sizeof(command_list)/sizeof(*command_list);
 
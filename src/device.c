@@ -0,0 +1,56 @@
+/*
+fuserescue, an on demand data recovery tool which recovers data on a first access basis.
+Copyright (C) 2018 Daniel Abrecht
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <fuserescue/fuserescue.h>
+#include <fuserescue/device.h>
+#include <errno.h>
+#include <unistd.h>
+
+static void pread_read(struct device* dev, struct device_read* reads, size_t count){
+  for(size_t i=0; i<count; i++){
+    struct device_read* rd = &reads[i];
+    do {
+      rd->result = pread(dev->fd,rd->buf,rd->size,rd->offset);
+    } while(rd->result < 0 && errno == EINTR);
+    rd->error = rd->result < 0 ? errno : 0;
+  }
+}
+
+static const struct device_ops pread_ops = {
+  .name = "pread",
+  .read = pread_read
+};
+
+// Blocking reads, one at a time, without any timeout
+void device_open_pread(struct device* dev, int fd){
+  *dev = (struct device){
+    .ops = &pread_ops,
+    .fd = fd,
+    .depth = 1
+  };
+}
+
+void device_read(struct device* dev, struct device_read* reads, size_t count){
+  dev->ops->read(dev,reads,count);
+}
+
+void device_close(struct device* dev){
+  if(dev->ops->close)
+    dev->ops->close(dev);
+  dev->data = 0;
+}
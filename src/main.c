@@ -20,6 +20,11 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <fuserescue/utils.h>
 #include <fuserescue/cmd.h>
 #include <fuserescue/map.h>
+#include <fuserescue/checkpoint.h>
+#include <fuserescue/range.h>
+#include <fuserescue/recover.h>
+#include <fuserescue/scheduler.h>
+#include <fuserescue/metadata.h>
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -32,36 +37,28 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <fuse.h>
+#include <fuse_lowlevel.h>
 
 #ifndef O_BINARY
 #define O_BINARY 0
 #endif
 
 
-static char readbuffer[DIRECTIO_BUFFER_SIZE] __attribute__ ((__aligned__ (4096)));
 
-
-
-void fr_save_map(struct fuserescue* fr){
-  pthread_mutex_lock(&fr->lock);
-  int mapfd = open(fr->mapfile,O_CREAT|O_WRONLY|O_TRUNC|O_BINARY,0660);
-  if(mapfd==-1){
-    perror("failed to open mapfile");
-    exit(5);
+bool fr_valid_blocksize(struct fuserescue* fr, uint64_t blocksize){
+  if(!blocksize || blocksize > BLOCKSIZE_MAX){
+    fprintf(stderr,"Blocksize must be between 1 and %d\n",BLOCKSIZE_MAX);
+    return false;
   }
-  if(!map_normalize(fr->map)){
-    printf("Bug: map became corrupted!!!\n");
-    map_write(fr->map,1); // write it to stdout
-    close(mapfd);
-    exit(5);
-  }
-  if(!map_write(fr->map,mapfd)){
-    perror("failed to write mapfile");
-    exit(5);
+  for(size_t i=0; i<fr->source_count; i++){
+    if(fr->source[i].directio && blocksize % fr->sector_size){
+      fprintf(stderr,"Blocksize must be a multiple of the sector size %"PRIu64" when using direct io\n",fr->sector_size);
+      return false;
+    }
   }
-  close(mapfd);
-  pthread_mutex_unlock(&fr->lock);
+  return true;
 }
 
 
@@ -86,247 +83,405 @@ static int fr_open(
   const char* path,
   struct fuse_file_info* fi
 ){
-  (void) fi;
-
   if(strcmp(path, "/"))
     return -ENOENT;
 
+  struct fuserescue* fr = fuse_get_context()->private_data;
+  fi->keep_cache = fr->kernel_cache;
+
   return 0;
 }
 
-static int fr_read(
+/*
+ * The state of the first part of [start, end) which may not be recovered, or if there is
+ * none, of the first part which isn't recovered. fr->lock must be held.
+ */
+static enum mapentry_state unfinished_state(struct fuserescue* fr, uint64_t start, uint64_t end){
+  enum mapentry_state state = ME_NONE;
+  bool found = false;
+  uint64_t pos = start;
+  struct map_iterator it;
+  struct mapentry entry;
+  map_iterate(fr->map,&it,start);
+  while(pos < end && map_next(&it,&entry)){
+    if(entry.offset >= end)
+      break;
+    if(entry.offset + entry.size <= pos)
+      continue;
+    if(entry.offset > pos)
+      found = true;
+    if(entry.state != ME_FINISHED){
+      if(!((1lu<<entry.state) & fr->recover_states))
+        return entry.state;
+      if(!found)
+        state = entry.state;
+      found = true;
+    }
+    pos = entry.offset + entry.size;
+  }
+  return state;
+}
+
+/*
+ * Areas which have to be recovered are handed to the scheduler. Once that's done,
+ * everything is returned as segments referring to the image, so fuse can splice
+ * them without copying them through this process.
+ * If the kernel may cache the image, reads bigger than a page are mostly its readahead.
+ * Those don't recover anything, they fail, and the kernel then reads the pages which
+ * are actually needed one by one. Short reads would make the kernel think the file
+ * ends there, so they fail too.
+ */
+static int fr_read_buf(
   const char* path,
-  char* buf,
+  struct fuse_bufvec** bufp,
   size_t size,
   off_t offset,
   struct fuse_file_info* fi
 ){
-  (void) buf;
   (void) fi;
 
   if(strcmp(path, "/"))
     return -ENOENT;
 
   struct fuserescue* fr = fuse_get_context()->private_data;
+  uint64_t begin = stats_now();
 
   if ((uint64_t)offset >= fr->size)
-    return 0;
+    size = 0;
 
   if(fr->size-offset < size)
     size = fr->size-offset;
 
-  bool error = false;
-  memset(buf,0,size);
-  
-  struct ranges {
-    uint64_t start, end;
-  };
+  int res = 0;
+  size_t served = 0;
+  struct range_list finished = {0};
+  struct range_list to_recover = {0};
+  struct range_list was_finished = {0}; // before recovering anything, for the trace
+  struct range_list was_to_recover = {0};
+
+  fr_lock(fr);
+  fr->demand++;
+  uint64_t start = stats_now();
+  bool ok = classify_range(fr,offset,offset+size,&finished,&to_recover);
+  stats_time(&fr->stats.map_lookup,start);
+  uint64_t generation;
+  bool cached = cache_enabled(&fr->cache,&generation);
+  bool allowed = fr->allowed;
+  uint64_t deadline = fr->deadline;
+  pthread_mutex_unlock(&fr->lock);
 
-  enum { max_slices=1024*1024 };
-  size_t to_recover_count = 1;
-  static struct ranges to_recover[max_slices];
-  to_recover[0].start = offset;
-  to_recover[0].end = offset+size;
-
-  pthread_mutex_lock(&fr->lock);
-  size_t to_recover_index = 0;
-  struct mapentry* entries = fr->map->entries;
-  for(size_t i=0,n=fr->map->count; i<n; i++){
-    if(entries[i].state != ME_FINISHED){
-      if( (1lu<<entries[i].state) & fr->recover_states )
-        continue;
-    }
-    uint64_t overlap_start = (uint64_t)offset > entries[i].offset ? (uint64_t)offset : entries[i].offset;
-    uint64_t overlap_end = (uint64_t)offset + size > entries[i].offset+entries[i].size ? entries[i].offset+entries[i].size : (uint64_t)offset + size;
-    if(overlap_start >= overlap_end)
-      continue;
-    if(entries[i].state == ME_FINISHED){
-      if((uint64_t)lseek(fr->outfile,overlap_start,SEEK_SET) != overlap_start){
-        perror("failed to lseek outfile");
-        exit(2);
-      }
-      size_t rcount = 0;
-      ssize_t ret;
-      do {
-        ret = read(fr->outfile, buf+(overlap_start-offset), overlap_end - overlap_start);
-        if(ret<0){
-          if(ret == EINTR)
-            continue;
-          perror("failed to read from outfile");
-          exit(2);
-        }
-        rcount += ret;
-      } while(!ret || rcount < overlap_end - overlap_start);
-      if(fr->loglevel >= LOGLEVEL_INFO)
-        printf("read %"PRIx64" - %"PRIx64"\n", overlap_start,overlap_end);
+  struct timespec until;
+  clock_gettime(CLOCK_MONOTONIC,&until);
+  until.tv_sec += deadline / 1000;
+  until.tv_nsec += deadline % 1000 * 1000000;
+  if(until.tv_nsec >= 1000000000){
+    until.tv_sec++;
+    until.tv_nsec -= 1000000000;
+  }
+
+  if(!ok || (to_recover.count && !allowed)){
+    res = -EIO;
+    goto end;
+  }
+
+  if(to_recover.count && fr->kernel_cache && size > (size_t)sysconf(_SC_PAGESIZE)){
+    stats_add(&fr->stats.readahead_rejected,1);
+    res = -EIO;
+    goto rejected;
+  }
+
+  if(to_recover.count){
+    struct range r = {to_recover.range[0].start,to_recover.range[to_recover.count-1].end};
+    struct recover_job* job = scheduler_submit(fr,r,PRIORITY_DEMAND,true);
+    bool done = true;
+    if(deadline){
+      done = scheduler_wait_until(fr,job,&until);
     }else{
-      error = true;
+      scheduler_wait(fr,job);
     }
-    if( overlap_start == to_recover[to_recover_index].start && overlap_end == to_recover[to_recover_index].end ){
-      to_recover_count--;
-      break;
+    was_finished = finished;
+    was_to_recover = to_recover;
+    finished = (struct range_list){0};
+    to_recover = (struct range_list){0};
+    fr_lock(fr);
+    start = stats_now();
+    ok = classify_range(fr,offset,offset+size,&finished,&to_recover);
+    stats_time(&fr->stats.map_lookup,start);
+    cached = cache_enabled(&fr->cache,&generation);
+    pthread_mutex_unlock(&fr->lock);
+    // Out of time, answer with what's there from the start on, the rest is recovered in the background.
+    // With the page cache, the kernel would take a short read for the end of the file.
+    if(!done && fr->fuse_directio && ok && finished.count && finished.range[0].start == (uint64_t)offset){
+      finished.count = 1;
+      to_recover.count = 0;
     }
-    if(overlap_start == to_recover[to_recover_index].start){
-      to_recover[to_recover_index].start = overlap_end;
-      continue;
+    if(!ok || to_recover.count){
+      res = -EIO;
+      goto end;
     }
-    if(overlap_end == to_recover[to_recover_index].end){
-      to_recover[to_recover_index].start = overlap_start;
-      continue;
+    if(done)
+      fr_readahead(fr,offset+size);
+  }
+
+  if(finished.count)
+    served = finished.range[finished.count-1].end - finished.range[0].start;
+  stats_add(&fr->stats.bytes_served,served);
+
+  if(cached && finished.count){
+    // The finished ranges are contiguous, answer with a single buffer, fuse frees it.
+    // This copies blocks which aren't cached instead of splicing them from the outfile.
+    size_t total = finished.range[finished.count-1].end - finished.range[0].start;
+    struct fuse_bufvec* bufvec = malloc(sizeof(struct fuse_bufvec));
+    char* data = malloc(total);
+    if(!bufvec || !data){
+      free(bufvec);
+      free(data);
+      res = -ENOMEM;
+      goto end;
     }
-    uint64_t sl_end = to_recover[to_recover_index].end;
-    to_recover[to_recover_index].end = overlap_start;
-    if(to_recover_count>=max_slices){
-      fprintf(stderr,"Error: too many fragmants to recover for this read. Trying to recover as many as possible. Try again later for the remaining ones.");
-      error = true;
-      break;
+    *bufvec = FUSE_BUFVEC_INIT(total);
+    bufvec->buf[0].mem = data;
+    for(size_t i=0; i<finished.count; i++){
+      struct range r = finished.range[i];
+      cache_read(fr,data+(r.start-finished.range[0].start),r,generation);
+      if(fr->loglevel >= LOGLEVEL_INFO)
+        printf("read %"PRIx64" - %"PRIx64" (cached)\n", r.start,r.end);
     }
-    to_recover_count++;
-    to_recover_index++;
-    to_recover[to_recover_index].start = overlap_end;
-    to_recover[to_recover_index].end = sl_end;
+    *bufp = bufvec;
+    goto end;
   }
-  bool allowed = fr->allowed;
-  uint64_t blocksize = fr->blocksize;
+
+  struct fuse_bufvec* bufvec = calloc(1,sizeof(struct fuse_bufvec)+(finished.count?finished.count-1:0)*sizeof(struct fuse_buf));
+  if(!bufvec){
+    res = -ENOMEM;
+    goto end;
+  }
+  bufvec->count = finished.count;
+  for(size_t i=0; i<finished.count; i++){
+    struct fuse_buf* b = &bufvec->buf[i];
+    struct range r = finished.range[i];
+    b->size = r.end - r.start;
+    b->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+    b->fd = fr->outfile;
+    b->pos = r.start;
+    if(fr->loglevel >= LOGLEVEL_INFO)
+      printf("read %"PRIx64" - %"PRIx64"\n", r.start,r.end);
+  }
+  *bufp = bufvec;
+
+end:
+  if(res == -EIO){
+    fr_lock(fr);
+    stats_add(&fr->stats.eio[unfinished_state(fr,offset,offset+size)],1);
+    pthread_mutex_unlock(&fr->lock);
+  }
+rejected:
+  stats_add(&fr->stats.reads,1);
+  {
+    // Everything which wasn't recovered in the end failed
+    struct range_list failed = {0};
+    if(res){
+      uint64_t pos = offset;
+      for(size_t i=0; i<finished.count; i++){
+        range_list_add(&failed,pos,finished.range[i].start);
+        pos = finished.range[i].end;
+      }
+      range_list_add(&failed,pos,offset+size);
+    }
+    if(was_to_recover.count){
+      trace_read(&fr->trace,begin,offset,size,res?res:(int32_t)served,&was_finished,&was_to_recover,&failed);
+    }else{
+      trace_read(&fr->trace,begin,offset,size,res?res:(int32_t)served,&finished,&to_recover,&failed);
+    }
+    range_list_clear(&failed);
+  }
+  range_list_clear(&finished);
+  range_list_clear(&to_recover);
+  range_list_clear(&was_finished);
+  range_list_clear(&was_to_recover);
+  fr_lock(fr);
+  if(!--fr->demand)
+    pthread_cond_signal(&fr->sweep_cond);
   pthread_mutex_unlock(&fr->lock);
+  pthread_cond_signal(&fr->checkpoint_cond);
 
-  if(to_recover_count && !allowed){
-    error = true;
-  }
-
-  if(to_recover_count && allowed){
-    enum { FORWARD, BACKWARD } direction = FORWARD;
-    for(ssize_t i=0,j=to_recover_count-1; i<=j;){
-      if(direction == FORWARD){
-        uint64_t s = to_recover[i].start;
-        uint64_t e = to_recover[i].end;
-        if(fr->loglevel >= LOGLEVEL_INFO)
-          printf("trying to recover %"PRIx64"+%"PRIx64" - %"PRIx64"\n", fr->offset,s,e);
-        if((uint64_t)lseek(fr->outfile,s,SEEK_SET) != s){
-          perror("failed to lseek outfile");
-          exit(2);
-        }
-        if((uint64_t)lseek(fr->infile,fr->offset+s,SEEK_SET) != fr->offset + s){
-          perror("failed to lseek infile");
-          exit(3);
-        }
-        do {
-          size_t m = e-s;
-          if(!m) break;
-          if(m > blocksize)
-            m = blocksize;
-          ssize_t ret;
-          do {
-            ret = read(fr->infile,readbuffer,m);
-          } while(ret < 0 && errno == EINTR);
-          if(ret<0){
-            error = true;
-            if(errno != EIO){
-              perror("read failed in an unexpected way");
-              goto end;
-            }
-            perror("forward read from infile failed");
-            pthread_mutex_lock(&fr->lock);
-            map_update(fr->map,s,s+m,ME_NON_SCRAPED);
-            map_update(fr->map,s+m,e,ME_NON_TRIED);
-            fr->unsaved = true;
-            pthread_mutex_unlock(&fr->lock);
-            to_recover[i].start = s + m;
-            direction = BACKWARD;
-            goto next;
-          }else{
-            memcpy(buf+(s-offset),readbuffer,ret);
-            if(write(fr->outfile,buf+(s-offset),m)<0){
-              perror("writing to outfile failed");
-              exit(2);
-            }
-            pthread_mutex_lock(&fr->lock);
-            map_update(fr->map,s,s+ret,ME_FINISHED);
-            fr->unsaved = true;
-            pthread_mutex_unlock(&fr->lock);
-            s += ret;
-          }
-        } while(s<e);
-        i++;
-      }else{
-        uint64_t s = to_recover[j].start;
-        uint64_t e = to_recover[j].end;
-        printf("trying to recover %"PRIx64"+%"PRIx64" - %"PRIx64"\n", fr->offset,s,e);
-        do {
-          size_t m = e-s;
-          if(!m) break;
-          if(m > blocksize)
-            m = blocksize;
-          if((uint64_t)lseek(fr->infile,fr->offset+(e-m),SEEK_SET) != fr->offset+(e-m)){
-            perror("failed to lseek infile");
-            exit(3);
-          }
-          ssize_t ret;
-          do {
-            ret = read(fr->infile,readbuffer,m);
-          } while(ret < 0 && errno == EINTR);
-          if(ret<0){
-            error = true;
-            if(errno != EIO){
-              perror("read failed in an unexpected way");
-              goto end;
-            }
-            perror("backward read from infile failed");
-            pthread_mutex_lock(&fr->lock);
-            map_update(fr->map,e-m,e,ME_NON_SCRAPED);
-            map_update(fr->map,s,e-m,ME_NON_TRIED);
-            fr->unsaved = true;
-            pthread_mutex_unlock(&fr->lock);
-            to_recover[i].end = e-m;
-            direction = FORWARD;
-            goto next;
-          }else{
-            memcpy(buf+(e-m-offset),readbuffer,ret);
-            if((uint64_t)lseek(fr->outfile,e-m,SEEK_SET) != e-m){
-              perror("failed to lseek outfile");
-              exit(2);
-            }
-            if(write(fr->outfile,buf+(e-m-offset),m)<0){
-              perror("writing to outfile failed");
-              exit(2);
-            }
-            pthread_mutex_lock(&fr->lock);
-            map_update(fr->map,s,s+ret,ME_FINISHED);
-            fr->unsaved = true;
-            pthread_mutex_unlock(&fr->lock);
-            e -= ret;
-          }
-        } while(s<e);
-        j--;
+  return res;
+}
+
+/*
+ * Tells the kernel to drop cached pages of ranges which aren't finished anymore.
+ * This can block until reads of those pages are answered, so it's done here
+ * instead of wherever the map is changed.
+ */
+static void* invalidate_thread(void* param){
+  struct fuserescue* fr = param;
+  fr_lock(fr);
+  while(!fr->exiting){
+    if(!fr->stale.count){
+      pthread_cond_wait(&fr->stale_cond,&fr->lock);
+      continue;
+    }
+    struct range_list stale = fr->stale;
+    fr->stale = (struct range_list){0};
+    struct fuse_chan* chan = fuse_session_next_chan(fuse_get_session(fr->fuse),0);
+    pthread_mutex_unlock(&fr->lock);
+    for(size_t i=0; i<stale.count; i++){
+      struct range r = stale.range[i];
+      int ret = fuse_lowlevel_notify_inval_inode(chan,FUSE_ROOT_ID,r.start,r.end-r.start);
+      if(ret && ret != -ENOENT){
+        errno = -ret;
+        perror("failed to invalidate cached pages");
       }
-      next:;
     }
+    range_list_clear(&stale);
+    fr_lock(fr);
   }
+  pthread_mutex_unlock(&fr->lock);
+  return 0;
+}
 
-end:
-  if(fr->unsaved)
-    fr_save_map(fr);
-  fr->unsaved = false;
+static void* fr_init(struct fuse_conn_info* conn){
+  // Allow fuse to splice data from the image instead of copying it
+  if(conn->capable & FUSE_CAP_SPLICE_WRITE)
+    conn->want |= FUSE_CAP_SPLICE_WRITE;
+  if(conn->capable & FUSE_CAP_SPLICE_MOVE)
+    conn->want |= FUSE_CAP_SPLICE_MOVE;
+  struct fuserescue* fr = fuse_get_context()->private_data;
+  fr->fuse = fuse_get_context()->fuse;
+  if(fr->kernel_cache){
+    int ret = pthread_create(&fr->invalidator,0,invalidate_thread,fr);
+    if(ret){
+      errno = ret;
+      perror("pthread_create failed");
+      exit(1);
+    }
+  }
+  return fr;
+}
 
-  return error ? -EIO : (int)size;
+static void fr_destroy(void* private_data){
+  struct fuserescue* fr = private_data;
+  if(!fr->kernel_cache)
+    return;
+  fr_lock(fr);
+  fr->exiting = true;
+  pthread_cond_signal(&fr->stale_cond);
+  pthread_mutex_unlock(&fr->lock);
+  pthread_join(fr->invalidator,0);
 }
 
 
 static struct fuse_operations fr_oper = {
+  .init     = fr_init,
+  .destroy  = fr_destroy,
   .getattr  = fr_getattr,
   .open     = fr_open,
-  .read     = fr_read
+  .read_buf = fr_read_buf
 };
 
 
 int main(int argc, char* argv[]){
   bool infile_directio = true;
   bool fuse_directio = false;
+  bool journal = false;
+  bool writeback = false;
+  bool multithreaded = false;
+  bool kernel_cache = false;
+  bool adaptive = false;
+  bool sweep = false;
+  bool metadata = false;
+  uint64_t blocksize = 0;
+  uint64_t readahead = 0;
+  uint64_t deadline = 0;
+  uint64_t cache_size = 0;
+  const char* stats_file = 0;
+  const char* trace_file = 0;
+  enum stats_format stats_format = STATS_JSON;
+  uint64_t stats_interval = 10;
+  bool io_uring = false;
+  uint64_t queue_depth = 1;
+  uint64_t read_timeout = 0;
+  const char* simulate = 0;
+  struct source sources[SOURCES_MAX];
+  size_t source_count = 1;
+  uint64_t checkpoint_updates = 0;
+  uint64_t checkpoint_interval = 1;
   for(int i=1; i<argc; i++){
     if(!strcmp(argv[i],"--infile-no-direct-io")){
       infile_directio = false;
     }else if(!strcmp(argv[i],"--fuse-direct-io")){
       fuse_directio = true;
+    }else if(!strcmp(argv[i],"--write-back")){
+      writeback = true;
+    }else if(!strcmp(argv[i],"--journal")){
+      journal = true;
+    }else if(!strcmp(argv[i],"--kernel-cache")){
+      kernel_cache = true;
+    }else if(!strcmp(argv[i],"--multithreaded")){
+      multithreaded = true;
+    }else if(!strcmp(argv[i],"--metadata")){
+      metadata = true;
+    }else if(!strcmp(argv[i],"--sweep")){
+      sweep = true;
+    }else if(!strcmp(argv[i],"--adaptive")){
+      adaptive = true;
+    }else if(!strncmp(argv[i],"--blocksize=",12)){
+      const char* s = argv[i] + 12;
+      if(!parseu64(&s,&blocksize) || *s)
+        goto wrongargs;
+    }else if(!strncmp(argv[i],"--simulate=",11)){
+      simulate = argv[i] + 11;
+    }else if(!strncmp(argv[i],"--source=",9)){
+      if(source_count >= SOURCES_MAX){
+        fprintf(stderr,"There can't be more than %d sources\n",SOURCES_MAX);
+        return 1;
+      }
+      if(!source_parse(&sources[source_count],argv[i]+9)){
+        perror("invalid source");
+        return 1;
+      }
+      source_count++;
+    }else if(!strcmp(argv[i],"--io-uring")){
+      io_uring = true;
+    }else if(!strncmp(argv[i],"--queue-depth=",14)){
+      const char* s = argv[i] + 14;
+      if(!parseu64(&s,&queue_depth) || *s || !queue_depth || queue_depth > QUEUE_DEPTH_MAX)
+        goto wrongargs;
+    }else if(!strncmp(argv[i],"--read-timeout=",15)){
+      const char* s = argv[i] + 15;
+      if(!parseu64(&s,&read_timeout) || *s)
+        goto wrongargs;
+    }else if(!strncmp(argv[i],"--trace=",8)){
+      trace_file = argv[i] + 8;
+    }else if(!strncmp(argv[i],"--stats-file=",13)){
+      stats_file = argv[i] + 13;
+    }else if(!strncmp(argv[i],"--stats-format=",15)){
+      if(!stats_parse_format(argv[i]+15,&stats_format))
+        goto wrongargs;
+    }else if(!strncmp(argv[i],"--stats-interval=",17)){
+      const char* s = argv[i] + 17;
+      if(!parseu64(&s,&stats_interval) || *s)
+        goto wrongargs;
+    }else if(!strncmp(argv[i],"--cache=",8)){
+      const char* s = argv[i] + 8;
+      if(!parseu64(&s,&cache_size) || *s)
+        goto wrongargs;
+    }else if(!strncmp(argv[i],"--deadline=",11)){
+      const char* s = argv[i] + 11;
+      if(!parseu64(&s,&deadline) || *s)
+        goto wrongargs;
+    }else if(!strncmp(argv[i],"--readahead=",12)){
+      const char* s = argv[i] + 12;
+      if(!parseu64(&s,&readahead) || *s)
+        goto wrongargs;
+    }else if(!strncmp(argv[i],"--checkpoint-updates=",21)){
+      const char* s = argv[i] + 21;
+      if(!parseu64(&s,&checkpoint_updates) || *s)
+        goto wrongargs;
+    }else if(!strncmp(argv[i],"--checkpoint-interval=",22)){
+      const char* s = argv[i] + 22;
+      if(!parseu64(&s,&checkpoint_interval) || *s)
+        goto wrongargs;
     }else if(argv[i][0] == '-'){
       goto wrongargs;
     }else continue;
@@ -336,20 +491,21 @@ int main(int argc, char* argv[]){
   }
   if(argc<5||argc>7){
   wrongargs:;
-    fprintf(stderr,"Usage: %s [--infile-no-direct-io|--fuse-direct-io] infile outfile mapfile mountpoint [offset] [size]\n",argv[0]);
+    fprintf(stderr,"Usage: %s [--infile-no-direct-io|--fuse-direct-io|--kernel-cache|--journal|--write-back|--multithreaded|--metadata|--sweep|--adaptive|--io-uring|--queue-depth=N|--read-timeout=ms|--simulate=mapfile[,options]|--source=path[,options]|--blocksize=N|--readahead=N|--deadline=ms|--cache=N|--stats-file=path|--stats-format=F|--stats-interval=seconds|--trace=file|--checkpoint-updates=N|--checkpoint-interval=seconds] infile outfile mapfile mountpoint [offset] [size]\n",argv[0]);
     return 1;
   }
-  int infile;
-  {
-    int flags = O_RDONLY | O_BINARY;
-    if(infile_directio)
-      flags |= O_DIRECT;
-    infile = open( argv[1], flags );
-  }
-  if(infile == -1){
-    perror("Failed to open input file");
-    return 1;
+  sources[0] = (struct source){
+    .path = strdup(argv[1]),
+    .fd = -1,
+    .directio = infile_directio
+  };
+  for(size_t i=0; i<source_count; i++){
+    if(!sources[i].path || !source_open(&sources[i])){
+      fprintf(stderr,"Failed to open input file %s: %s\n",sources[i].path ? sources[i].path : argv[1],strerror(errno));
+      return 1;
+    }
   }
+  int infile = sources[0].fd;
   uint64_t offset = 0;
   long long insize = lseek( infile, 0, SEEK_END );
   if(insize < 0){
@@ -363,6 +519,7 @@ int main(int argc, char* argv[]){
       return 1;
     }
     insize -= offset;
+    sources[0].offset = offset;
   }
   if(argc >= 7){
     const char* s = argv[6];
@@ -373,7 +530,7 @@ int main(int argc, char* argv[]){
     }
     insize = size;
   }
-  int outfile = open( argv[2], O_RDWR | O_SYNC | O_BINARY | O_CREAT, 0660 );
+  int outfile = open( argv[2], O_RDWR | (writeback ? 0 : O_SYNC) | O_BINARY | O_CREAT, 0660 );
   if(outfile == -1){
     perror("Failed to open output file");
     return 1;
@@ -390,6 +547,10 @@ int main(int argc, char* argv[]){
     fprintf(stderr,"Failed to read map file\n");
     return 1;
   }
+  if(journal && !map_journal_open(map,argv[3])){
+    perror("Failed to open journal");
+    return 1;
+  }
   struct stat stbuf;
   if( stat(argv[4], &stbuf) == -1 ){
     perror("failed to stat mountpoint");
@@ -399,42 +560,168 @@ int main(int argc, char* argv[]){
     fprintf(stderr, "mountpoint is not a regular file\n");
     return 1;
   }
-  int sector_size = 0;
-  if(ioctl(outfile, BLKSSZGET, &sector_size)<0 || !sector_size)
-    sector_size = 512;
-  if((unsigned)sector_size > sizeof(readbuffer))
-    sector_size = sizeof(readbuffer);
+  // The largest sector size of all sources, so reads are aligned for all of them
+  int sector_size = 512;
+  for(size_t i=0; i<source_count; i++){
+    int size = 0;
+    if(ioctl(sources[i].fd, BLKSSZGET, &size) >= 0 && size > sector_size)
+      sector_size = size;
+  }
+  // Reads are aligned for the infile, the other sources get the same reads moved by the difference of the offsets
+  for(size_t i=1; i<source_count; i++){
+    if(sources[i].directio && (sources[i].offset - offset) % sector_size){
+      fprintf(stderr,"The offset of %s has to be as far from a sector boundary as the one of the infile, or it needs no-direct-io\n",sources[i].path);
+      return 1;
+    }
+  }
+  if(source_count > 1){
+    for(size_t i=0; i<source_count; i++){
+      char* path = source_mapfile(argv[3],i);
+      sources[i].recovered = map_read(path);
+      free(path);
+      if(!sources[i].recovered){
+        fprintf(stderr,"Failed to read map file of source %zu\n",i);
+        return 1;
+      }
+    }
+  }
+  if(!blocksize)
+    blocksize = sector_size;
   struct fuserescue params = {
-    .infile = infile,
     .outfile = outfile,
-    .offset = offset,
-    .infile_path = strdup(argv[1]),
-    .infile_directio = infile_directio,
-    .blocksize = sector_size,
+    .writeback = writeback,
+    .source = sources,
+    .source_count = source_count,
+    .blocksize = blocksize,
+    .adaptive = adaptive,
+    .readahead = readahead,
+    .deadline = deadline,
+    .kernel_cache = kernel_cache,
+    .fuse_directio = fuse_directio,
+    .stats = {
+      .file = stats_file ? strdup(stats_file) : 0,
+      .format = stats_format,
+      .interval = stats_interval
+    },
+    .sweep = sweep,
+    .metadata_scan = metadata,
+    .sector_size = sector_size,
     .size = insize,
     .map = map,
     .mapfile = strdup(argv[3]),
     .self = pthread_self(),
-    .unsaved = false,
+    .unsaved = 0,
+    .checkpoint_updates = checkpoint_updates,
+    .checkpoint_interval = checkpoint_interval,
     .allowed = false,
     .recover_states = (1<<ME_NON_TRIMMED) | (1<<ME_NON_TRIED),
     .loglevel = LOGLEVEL_DEFAULT
   };
+  if(!fr_valid_blocksize(&params,blocksize))
+    return 1;
+  if(kernel_cache && fuse_directio){
+    fprintf(stderr,"--kernel-cache and --fuse-direct-io can't be used together\n");
+    return 1;
+  }
+  if(simulate && io_uring){
+    fprintf(stderr,"--simulate and --io-uring can't be used together\n");
+    return 1;
+  }
+  if(!io_uring && (queue_depth > 1 || (read_timeout && !simulate))){
+    fprintf(stderr,"--queue-depth and --read-timeout need --io-uring, --read-timeout also works with --simulate\n");
+    return 1;
+  }
+  // Only the infile can be simulated
+  for(size_t i=0; i<source_count; i++){
+    struct device* device = &sources[i].device;
+    if(simulate && !i){
+      if(!device_open_simulation(device,infile,simulate,sector_size,read_timeout)){
+        perror("Failed to set up the simulated device");
+        return 3;
+      }
+    }else if(!io_uring){
+      device_open_pread(device,sources[i].fd);
+    }else if(!device_open_uring(device,sources[i].fd,queue_depth,read_timeout)){
+      perror("io_uring isn't available, using blocking reads instead");
+      device_open_pread(device,sources[i].fd);
+    }
+    if(device->depth > params.depth)
+      params.depth = device->depth;
+  }
   pthread_mutex_init(&params.lock,0);
-  pthread_t ctlt;
-  int ret = pthread_create(&ctlt,0,cmd_controller,&params);
-  if(ret < 0){
+  pthread_mutex_init(&params.save_lock,0);
+  cache_init(&params.cache,cache_size);
+  if(trace_file && !trace_open(&params.trace,trace_file)){
+    perror("Failed to open trace file");
+    return 1;
+  }
+  pthread_cond_init(&params.scheduler_cond,0);
+  pthread_cond_init(&params.sweep_cond,0);
+  pthread_cond_init(&params.metadata_cond,0);
+  pthread_cond_init(&params.stale_cond,0);
+  {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr,CLOCK_MONOTONIC);
+    pthread_cond_init(&params.checkpoint_cond,&attr);
+    pthread_cond_init(&params.completed_cond,&attr);
+    pthread_cond_init(&params.stats.cond,&attr);
+    pthread_condattr_destroy(&attr);
+  }
+  if(journal)
+    fr_save_map(&params); // Start with an empty journal
+  pthread_t ctlt, checkpointt, schedulert, sweept, metadatat, statst;
+  int ret = pthread_create(&checkpointt,0,checkpoint_thread,&params);
+  if(ret){
+    errno = ret;
+    perror("pthread_create failed");
+    return 1;
+  }
+  ret = pthread_create(&schedulert,0,scheduler_thread,&params);
+  if(ret){
+    errno = ret;
+    perror("pthread_create failed");
+    return 1;
+  }
+  ret = pthread_create(&metadatat,0,metadata_thread,&params);
+  if(ret){
+    errno = ret;
+    perror("pthread_create failed");
+    return 1;
+  }
+  ret = pthread_create(&sweept,0,sweep_thread,&params);
+  if(ret){
+    errno = ret;
+    perror("pthread_create failed");
+    return 1;
+  }
+  ret = pthread_create(&statst,0,stats_thread,&params);
+  if(ret){
+    errno = ret;
+    perror("pthread_create failed");
+    return 1;
+  }
+  ret = pthread_create(&ctlt,0,cmd_controller,&params);
+  if(ret){
+    errno = ret;
     perror("pthread_create failed");
     return 1;
   }
   pthread_detach(ctlt);
-  char* options[] = {
-    argv[0], "-s", "-f", "-o", "ro", "-o", "auto_unmount",
-    "-o", "hard_remove", "-o", "max_readahead=0",
-    "-o" "sync_read",
-    0,0,0
+  char* options[16] = {
+    argv[0], "-f", "-o", "ro", "-o", "auto_unmount",
+    "-o", "hard_remove"
   };
-  size_t n = 12;
+  size_t n = 8;
+  if(!kernel_cache){
+    options[n++] = "-o";
+    options[n++] = "max_readahead=0";
+  }
+  if(!multithreaded){
+    options[n++] = "-s";
+    options[n++] = "-o";
+    options[n++] = "sync_read";
+  }
   if(fuse_directio){
     options[n++] = "-o";
     options[n++] = "direct_io";
@@ -442,7 +729,24 @@ int main(int argc, char* argv[]){
   options[n++] = argv[4];
   struct fuse_args args = FUSE_ARGS_INIT(n, options);
   int es = fuse_main(args.argc, args.argv, &fr_oper, &params);
+  pthread_mutex_lock(&params.lock);
+  params.exiting = true;
+  pthread_cond_signal(&params.checkpoint_cond);
+  pthread_cond_signal(&params.scheduler_cond);
+  pthread_cond_signal(&params.sweep_cond);
+  pthread_cond_signal(&params.metadata_cond);
+  pthread_cond_signal(&params.stats.cond);
+  pthread_mutex_unlock(&params.lock);
+  pthread_join(schedulert,0);
+  pthread_join(metadatat,0);
+  pthread_join(sweept,0);
+  pthread_join(checkpointt,0);
+  pthread_join(statst,0);
   fr_save_map(&params);
+  for(size_t i=0; i<source_count; i++)
+    source_close(&sources[i]);
+  cache_free(&params.cache);
+  trace_close(&params.trace);
   pthread_kill(ctlt,SIGTERM);
   return es;
 }
@@ -16,9 +16,14 @@ You should have received a copy of the GNU General Public License
 along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#define _GNU_SOURCE
+
 #include <fuserescue/map.h>
 #include <fuserescue/utils.h>
 
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -26,152 +31,852 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <inttypes.h>
 
 
+enum {
+  MAP_LEAF_MAX = 128,
+  MAP_INNER_MAX = 64,
+  MAP_STATE_SHIFT = 60
+};
+
+struct map_node {
+  unsigned count;
+  unsigned refs; // maps and inner nodes pointing to this node, see map_clone
+  bool leaf;
+};
+
+// Sizes aren't stored, an entry ends where the next one starts
+struct map_leaf {
+  struct map_node node;
+  uint64_t entry[MAP_LEAF_MAX]; // state in the upper 4 bits, offset in the lower 60 bits
+};
+
+struct map_inner {
+  struct map_node node;
+  uint64_t key[MAP_INNER_MAX]; // smallest offset of each child
+  struct map_node* child[MAP_INNER_MAX];
+};
+
+#define LEAF(X) ((struct map_leaf*)(X))
+#define INNER(X) ((struct map_inner*)(X))
+
+static inline uint64_t entry_pack(uint64_t offset, enum mapentry_state state){
+  return (uint64_t)state << MAP_STATE_SHIFT | offset;
+}
+
+static inline uint64_t entry_offset(uint64_t entry){
+  return entry & MAP_OFFSET_MAX;
+}
+
+static inline enum mapentry_state entry_state(uint64_t entry){
+  return entry >> MAP_STATE_SHIFT;
+}
+
+static inline unsigned node_max(const struct map_node* node){
+  return node->leaf ? MAP_LEAF_MAX : MAP_INNER_MAX;
+}
+
+static inline uint64_t node_key(const struct map_node* node, unsigned i){
+  return node->leaf ? entry_offset(LEAF(node)->entry[i]) : INNER(node)->key[i];
+}
+
+static struct map_node* node_create(bool leaf){
+  struct map_node* node = calloc(1,leaf?sizeof(struct map_leaf):sizeof(struct map_inner));
+  if(!node){
+    perror("failed to allocate map node");
+    exit(4);
+  }
+  node->leaf = leaf;
+  node->refs = 1;
+  return node;
+}
+
+// Drops a reference to the node, freeing it once nothing points to it anymore
+static void node_release(struct map_node* node){
+  if(__atomic_sub_fetch(&node->refs,1,__ATOMIC_ACQ_REL))
+    return;
+  if(!node->leaf)
+    for(unsigned i=0; i<node->count; i++)
+      node_release(INNER(node)->child[i]);
+  free(node);
+}
+
+// Returns the index of the last key <= x, or -1 if there is none
+static int node_find(const struct map_node* node, uint64_t x){
+  unsigned l=0, r=node->count;
+  while(l<r){
+    unsigned m = (l+r) / 2;
+    if(node_key(node,m) <= x){
+      l = m + 1;
+    }else{
+      r = m;
+    }
+  }
+  return (int)l - 1;
+}
+
+// Moves all entries starting at index i by n
+static void node_shift(struct map_node* node, unsigned i, int n){
+  unsigned m = node->count - i;
+  if(m){
+    if(node->leaf){
+      struct map_leaf* leaf = LEAF(node);
+      memmove(leaf->entry+i+n,leaf->entry+i,m*sizeof(*leaf->entry));
+    }else{
+      struct map_inner* inner = INNER(node);
+      memmove(inner->key+i+n,inner->key+i,m*sizeof(*inner->key));
+      memmove(inner->child+i+n,inner->child+i,m*sizeof(*inner->child));
+    }
+  }
+  node->count += n;
+}
+
+static void node_copy(struct map_node* dst, unsigned j, const struct map_node* src, unsigned i, unsigned n){
+  if(dst->leaf){
+    memcpy(LEAF(dst)->entry+j,LEAF(src)->entry+i,n*sizeof(*LEAF(dst)->entry));
+  }else{
+    memcpy(INNER(dst)->key+j,INNER(src)->key+i,n*sizeof(*INNER(dst)->key));
+    memcpy(INNER(dst)->child+j,INNER(src)->child+i,n*sizeof(*INNER(dst)->child));
+  }
+}
+
+// Copies *slot if it's shared with a clone of the map, so it can be changed
+static struct map_node* node_own(struct map_node** slot){
+  struct map_node* node = *slot;
+  if(__atomic_load_n(&node->refs,__ATOMIC_ACQUIRE) == 1)
+    return node;
+  struct map_node* copy = node_create(node->leaf);
+  node_copy(copy,0,node,0,node->count);
+  copy->count = node->count;
+  if(!node->leaf)
+    for(unsigned i=0; i<node->count; i++)
+      __atomic_add_fetch(&INNER(node)->child[i]->refs,1,__ATOMIC_RELAXED);
+  node_release(node);
+  *slot = copy;
+  return copy;
+}
+
+// Inserts an entry at index i, returns the new right sibling if the node had to be split
+static struct map_node* node_put(struct map_node* node, unsigned i, uint64_t value, struct map_node* child){
+  struct map_node* sibling = 0;
+  if(node->count >= node_max(node)){
+    // Appending is the common case when a map is read or recovered sequentially, keep those nodes full
+    bool append = i == node->count;
+    unsigned half = append ? node->count : node->count / 2;
+    sibling = node_create(node->leaf);
+    node_copy(sibling,0,node,half,node->count-half);
+    sibling->count = node->count - half;
+    node->count = half;
+    if(append || i > half){
+      i -= half;
+      node = sibling;
+    }
+  }
+  node_shift(node,i,1);
+  if(node->leaf){
+    LEAF(node)->entry[i] = value;
+  }else{
+    INNER(node)->key[i] = value;
+    INNER(node)->child[i] = child;
+  }
+  return sibling;
+}
+
+static struct map_node* node_insert(struct map_node* node, uint64_t key, enum mapentry_state state, bool* added){
+  int i = node_find(node,key);
+  if(node->leaf){
+    if(i >= 0 && node_key(node,i) == key){
+      LEAF(node)->entry[i] = entry_pack(key,state);
+      return 0;
+    }
+    *added = true;
+    return node_put(node,i+1,entry_pack(key,state),0);
+  }
+  if(i < 0)
+    i = 0;
+  struct map_inner* inner = INNER(node);
+  struct map_node* child = node_own(&inner->child[i]);
+  struct map_node* sibling = node_insert(child,key,state,added);
+  inner->key[i] = node_key(child,0);
+  if(!sibling)
+    return 0;
+  return node_put(node,i+1,node_key(sibling,0),sibling);
+}
+
+// Merges or evens out the children l and l+1 of node
+static void node_rebalance(struct map_inner* node, unsigned l){
+  struct map_node* left = node_own(&node->child[l]);
+  struct map_node* right = node_own(&node->child[l+1]);
+  if(left->count + right->count <= node_max(left)){
+    node_copy(left,left->count,right,0,right->count);
+    left->count += right->count;
+    free(right);
+    node_shift(&node->node,l+2,-1);
+  }else{
+    unsigned want = (left->count + right->count) / 2;
+    if(left->count < want){
+      unsigned n = want - left->count;
+      node_copy(left,left->count,right,0,n);
+      left->count += n;
+      node_shift(right,n,-(int)n);
+    }else{
+      unsigned n = left->count - want;
+      node_shift(right,0,n);
+      node_copy(right,0,left,left->count-n,n);
+      left->count -= n;
+    }
+    node->key[l+1] = node_key(right,0);
+  }
+  node->key[l] = node_key(left,0);
+}
+
+static bool node_erase(struct map_node* node, uint64_t key){
+  int i = node_find(node,key);
+  if(i < 0)
+    return false;
+  if(node->leaf){
+    if(node_key(node,i) != key)
+      return false;
+    node_shift(node,i+1,-1);
+    return true;
+  }
+  struct map_inner* inner = INNER(node);
+  struct map_node* child = node_own(&inner->child[i]);
+  if(!node_erase(child,key))
+    return false;
+  if(!child->count){
+    free(child);
+    node_shift(node,i+1,-1);
+    return true;
+  }
+  inner->key[i] = node_key(child,0);
+  if(child->count < node_max(child) / 4 && node->count > 1)
+    node_rebalance(inner, i ? i-1 : 0);
+  return true;
+}
+
+static void map_insert(struct mapfile* map, uint64_t key, enum mapentry_state state){
+  if(key > MAP_OFFSET_MAX){
+    fprintf(stderr,"map_insert failed: offset %"PRIx64" out of range\n",key);
+    exit(4);
+  }
+  if(!map->root){
+    map->root = node_create(true);
+    map->height = 1;
+  }
+  bool added = false;
+  struct map_node* sibling = node_insert(node_own(&map->root),key,state,&added);
+  if(added)
+    map->count++;
+  if(!sibling)
+    return;
+  if(map->height >= MAP_DEPTH_MAX){
+    fprintf(stderr,"map_insert failed: tree too deep\n");
+    exit(4);
+  }
+  struct map_inner* root = INNER(node_create(false));
+  root->node.count = 2;
+  root->key[0] = node_key(map->root,0);
+  root->child[0] = map->root;
+  root->key[1] = node_key(sibling,0);
+  root->child[1] = sibling;
+  map->root = &root->node;
+  map->height++;
+}
+
+static void map_erase(struct mapfile* map, uint64_t key){
+  if(!map->root || !node_erase(node_own(&map->root),key))
+    return;
+  map->count--;
+  while(!map->root->leaf && map->root->count == 1){
+    struct map_node* root = map->root;
+    map->root = INNER(root)->child[0];
+    map->height--;
+    free(root);
+  }
+  if(!map->root->count){
+    free(map->root);
+    map->root = 0;
+    map->height = 0;
+  }
+}
+
+// Positions the iterator at the last boundary <= offset, or at the first boundary if there is none
+void map_iterate(struct mapfile* map, struct map_iterator* it, uint64_t offset){
+  it->depth = 0;
+  struct map_node* node = map->root;
+  if(!node || !node->count)
+    return;
+  while(true){
+    int i = node_find(node,offset);
+    if(i < 0)
+      i = 0;
+    it->node[it->depth] = node;
+    it->index[it->depth] = i;
+    it->depth++;
+    if(node->leaf)
+      break;
+    node = INNER(node)->child[i];
+  }
+}
+
+static void iter_advance(struct map_iterator* it){
+  while(it->depth){
+    unsigned d = it->depth - 1;
+    if(++it->index[d] < it->node[d]->count)
+      break;
+    it->depth--;
+  }
+  if(!it->depth)
+    return;
+  for(unsigned d=it->depth-1; !it->node[d]->leaf; d++){
+    it->node[d+1] = INNER(it->node[d])->child[it->index[d]];
+    it->index[d+1] = 0;
+    it->depth = d + 2;
+  }
+}
+
+static inline uint64_t iter_offset(const struct map_iterator* it){
+  return entry_offset(LEAF(it->node[it->depth-1])->entry[it->index[it->depth-1]]);
+}
+
+static inline enum mapentry_state iter_state(const struct map_iterator* it){
+  return entry_state(LEAF(it->node[it->depth-1])->entry[it->index[it->depth-1]]);
+}
+
+bool map_next(struct map_iterator* it, struct mapentry* entry){
+  while(it->depth){
+    uint64_t offset = iter_offset(it);
+    enum mapentry_state state = iter_state(it);
+    iter_advance(it);
+    if(state == ME_NONE || !it->depth)
+      continue;
+    entry->offset = offset;
+    entry->size = iter_offset(it) - offset;
+    entry->state = state;
+    return true;
+  }
+  return false;
+}
+
+enum mapentry_state map_state_at(struct mapfile* map, uint64_t offset){
+  struct map_iterator it;
+  map_iterate(map,&it,offset);
+  if(!it.depth || iter_offset(&it) > offset)
+    return ME_NONE;
+  return iter_state(&it);
+}
+
 bool map_normalize(struct mapfile* map){
-  struct mapentry* entries = map->entries;
-  for(size_t j=map->count; j--;)
-    for(size_t i=0; i<j; i++)
-      if(entries[i].offset > entries[i+1].offset){
-        printf("switching %zu <> %zu\n",i,i+1);
-        struct mapentry e = entries[i];
-        entries[i] = entries[i+1];
-        entries[i+1] = e;
-      }
-  for(size_t i=1; i<map->count; i++){
-    uint64_t e = entries[i-1].offset + entries[i-1].size;
-    if(entries[i].offset<e){
-      fprintf(stderr,"Failed to normalize mapfile: overlapping entries not allowed. %"PRIx64"-%"PRIx64" %"PRIx64"-%"PRIx64"\n",entries[i-1].offset,e,entries[i].offset,entries[i].offset+entries[i].size);
+  struct map_iterator it;
+  map_iterate(map,&it,0);
+  if(!it.depth)
+    return true;
+  uint64_t offset = iter_offset(&it);
+  enum mapentry_state state = iter_state(&it);
+  if(state == ME_NONE){
+    map_erase(map,offset);
+    return map_normalize(map);
+  }
+  while(true){
+    iter_advance(&it);
+    if(!it.depth)
+      break;
+    uint64_t next = iter_offset(&it);
+    if(next <= offset){
+      fprintf(stderr,"Failed to normalize mapfile: entries out of order. %"PRIx64" %"PRIx64"\n",offset,next);
       return false;
     }
-    if( entries[i].offset==e && entries[i].state==entries[i-1].state ){
-      entries[i-1].size += entries[i].size;
-      map_move(map,i+1,-1);
+    if(iter_state(&it) == state){
+      map_erase(map,next);
+      map_iterate(map,&it,offset);
+      continue;
     }
+    offset = next;
+    state = iter_state(&it);
+  }
+  if(state != ME_NONE){
+    fprintf(stderr,"Failed to normalize mapfile: last entry at %"PRIx64" has no end\n",offset);
+    return false;
   }
   return true;
 }
 
-struct mapfile* map_read(const char* file){
-  struct mapfile* map = calloc(1,sizeof(struct mapfile));
-  if(!map){
+/*
+ * Returns a copy of the map without the journal. The copy shares all nodes with
+ * the map, a node only gets copied when either of them changes it. So the copy
+ * can be used and freed by another thread without locking while the map changes.
+ */
+struct mapfile* map_clone(struct mapfile* map){
+  struct mapfile* copy = malloc(sizeof(struct mapfile));
+  if(!copy){
     perror("failed to allocate map file");
-    return 0;
+    exit(4);
   }
-  FILE* f = fopen(file,"rb");
-  if(!f){
-    if(errno==ENOENT)
-      return map;
-    perror("Faile to open map file");
-    free(map);
+  *copy = *map;
+  copy->journal = 0;
+  if(map->root)
+    __atomic_add_fetch(&map->root->refs,1,__ATOMIC_RELAXED);
+  return copy;
+}
+
+void map_free(struct mapfile* map){
+  if(map->root)
+    node_release(map->root);
+  if(map->journal){
+    close(map->journal->fd);
+    free(map->journal->pending);
+    free(map->journal);
+  }
+  free(map);
+}
+
+// Builds the tree bottom up from sorted boundaries. The map has to be empty.
+static void map_build(struct mapfile* map, const uint64_t* entry, size_t count){
+  if(!count)
+    return;
+  size_t n = (count + MAP_LEAF_MAX - 1) / MAP_LEAF_MAX;
+  struct map_node** level = malloc(n * sizeof(*level));
+  if(!level){
+    perror("failed to allocate map nodes");
+    exit(4);
+  }
+  for(size_t i=0,j=0; i<n; i++){
+    size_t m = (count - j) / (n - i);
+    struct map_leaf* leaf = LEAF(node_create(true));
+    memcpy(leaf->entry,entry+j,m*sizeof(*entry));
+    leaf->node.count = m;
+    level[i] = &leaf->node;
+    j += m;
+  }
+  map->height = 1;
+  while(n > 1){
+    size_t p = (n + MAP_INNER_MAX - 1) / MAP_INNER_MAX;
+    for(size_t i=0,j=0; i<p; i++){
+      size_t m = (n - j) / (p - i);
+      struct map_inner* inner = INNER(node_create(false));
+      for(size_t k=0; k<m; k++){
+        inner->child[k] = level[j+k];
+        inner->key[k] = node_key(level[j+k],0);
+      }
+      inner->node.count = m;
+      level[i] = &inner->node;
+      j += m;
+    }
+    n = p;
+    map->height++;
+  }
+  map->root = level[0];
+  map->count = count;
+  free(level);
+}
+
+// Returns the whole file, mmapped if possible
+static char* file_load(int fd, size_t* size, bool* mapped){
+  struct stat st;
+  if(!fstat(fd,&st) && S_ISREG(st.st_mode) && st.st_size > 0){
+    void* data = mmap(0,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+    if(data != MAP_FAILED){
+      madvise(data,st.st_size,MADV_SEQUENTIAL);
+      *size = st.st_size;
+      *mapped = true;
+      return data;
+    }
+  }
+  *mapped = false;
+  *size = 0;
+  size_t capacity = 0;
+  char* data = 0;
+  while(true){
+    if(*size == capacity){
+      capacity = capacity ? capacity * 2 : 0x10000;
+      char* tmp = realloc(data,capacity);
+      if(!tmp){
+        free(data);
+        return 0;
+      }
+      data = tmp;
+    }
+    ssize_t ret = read(fd,data+*size,capacity-*size);
+    if(ret < 0){
+      if(errno == EINTR)
+        continue;
+      free(data);
+      return 0;
+    }
+    if(!ret)
+      break;
+    *size += ret;
+  }
+  return data;
+}
+
+static inline const char* skip_blanks(const char* s, const char* end){
+  while(s < end && (*s == ' ' || *s == '\t' || *s == '\r'))
+    s++;
+  return s;
+}
+
+// Same notation as parseu64, but bounded by end. Returns 0 on failure.
+static const char* parse_number(const char* s, const char* end, uint64_t* ret){
+  unsigned base = 10;
+  if(s < end && *s == '0'){
+    base = 8;
+    if(s+1 < end && s[1] == 'x'){
+      base = 16;
+      s += 2;
+    }
+  }
+  const uint64_t limit = UINT64_MAX / base;
+  const char* digits = s;
+  uint64_t res = 0;
+  for(; s<end; s++){
+    unsigned c = *s, digit;
+    if(c - '0' < 10){
+      digit = c - '0';
+    }else if((c|0x20) - 'a' < 26){
+      digit = (c|0x20) - 'a' + 10;
+    }else break;
+    if(digit >= base)
+      break;
+    if(res > limit || res * base > UINT64_MAX - digit){
+      errno = EOVERFLOW;
+      return 0;
+    }
+    res = res * base + digit;
+  }
+  if(s == digits){
+    errno = EINVAL;
     return 0;
   }
-  char buffer[257] = {0};
-  bool skip = false;
-  enum {
-    ST_STATUSLINE,
-    ST_ENTRY
-  } state = ST_STATUSLINE;
-  while(fgets(buffer,sizeof(buffer),f)){
-    size_t size = strlen(buffer);
-    if(skip && buffer[size-1] != '\n')
+  *ret = res;
+  return s;
+}
+
+static int load_entry_compare(const void* a, const void* b){
+  uint64_t x = entry_offset(*(const uint64_t*)a);
+  uint64_t y = entry_offset(*(const uint64_t*)b);
+  return x < y ? -1 : x > y;
+}
+
+/*
+ * Parses all entries into pairs of packed offset and state plus size, sorts them
+ * if they are out of order, and then turns them into boundaries in place, merging
+ * adjacent entries with the same state. The boundaries are then used to build the tree.
+ */
+static bool map_parse(struct mapfile* map, const char* s, const char* end){
+  size_t count = 0, capacity = 0;
+  uint64_t* entries = 0;
+  bool sorted = true;
+  bool have_status = false;
+  size_t line = 0;
+  for(const char* eol; s < end; s = eol + 1){
+    line++;
+    eol = memchr(s,'\n',end-s);
+    if(!eol)
+      eol = end;
+    s = skip_blanks(s,eol);
+    if(s == eol || *s == '#')
       continue;
-    skip = false;
-    if(buffer[0] == '#'){
-      skip = buffer[size-1] == '\n';
+    if(!have_status){
+      uint64_t total;
+      if(!(s=parse_number(s,eol,&total))){
+        fprintf(stderr,"Failed to parse total on line %zu: %s\n",line,strerror(errno));
+        goto error;
+      }
+      map->total = total;
+      s = skip_blanks(s,eol);
+      switch(s < eol ? *s : 0){
+        case '?': map->state=MF_NON_TRIED; break;
+        case '*': map->state=MF_NON_TRIMMED; break;
+        case '/': map->state=MF_NON_SCRAPED; break;
+        case '-': map->state=MF_BAD_SECTOR; break;
+        case 'F': map->state=MF_SPECIFIED_BLOCKS; break;
+        case 'G': map->state=MF_APPROXIMATE; break;
+        case '+': map->state=MF_FINISHED; break;
+        default: fprintf(stderr,"Failed to parse status on line %zu\n",line); goto error;
+      }
+      have_status = true;
       continue;
     }
-    if(buffer[size-1] != '\n'){
-      fprintf(stderr,"Reading mapfile failed, line too long\n");
-      free(map);
-      fclose(f);
-      return 0;
+    uint64_t offset, size;
+    enum mapentry_state state;
+    if(!(s=parse_number(s,eol,&offset))){
+      fprintf(stderr,"Failed to parse offset on line %zu: %s\n",line,strerror(errno));
+      goto error;
+    }
+    s = skip_blanks(s,eol);
+    if(!(s=parse_number(s,eol,&size))){
+      fprintf(stderr,"Failed to parse size on line %zu: %s\n",line,strerror(errno));
+      goto error;
+    }
+    s = skip_blanks(s,eol);
+    switch(s < eol ? *s : 0){
+      case '?': state=ME_NON_TRIED; break;
+      case '*': state=ME_NON_TRIMMED; break;
+      case '/': state=ME_NON_SCRAPED; break;
+      case '-': state=ME_BAD_SECTOR; break;
+      case '+': state=ME_FINISHED; break;
+      default: fprintf(stderr,"Failed to parse map file entry on line %zu\n",line); goto error;
+    }
+    if(!size)
+      continue;
+    if(offset > MAP_OFFSET_MAX || MAP_OFFSET_MAX - offset < size){
+      fprintf(stderr,"Mapfile entry %"PRIx64"+%"PRIx64" out of range\n",offset,size);
+      goto error;
     }
-    buffer[--size] = 0;
-
-    const char* s = buffer;
-
-    switch(state){
-      case ST_STATUSLINE: {
-        skip_spaces(&s);
-        if(!*s) continue;
-        if(!parseu64(&s,&map->total)){
-          perror("Failed to parse total");
-          return 0;
-        }
-        skip_spaces(&s);
-        char c = *s;
-        switch(c){
-          case '?': map->state=MF_NON_TRIED; break;
-          case '*': map->state=MF_NON_TRIMMED; break;
-          case '/': map->state=MF_NON_SCRAPED; break;
-          case '-': map->state=MF_BAD_SECTOR; break;
-          case 'F': map->state=MF_SPECIFIED_BLOCKS; break;
-          case 'G': map->state=MF_APPROXIMATE; break;
-          case '+': map->state=MF_FINISHED; break;
-          default: fprintf(stderr,"Failed to parse status\n"); return 0;
-        }
-        state = ST_ENTRY;
-      }; break;
-      case ST_ENTRY: {
-        skip_spaces(&s);
-        if(!*s) continue;
-        if(map->count >= ENTRIES_MAX){
-          fprintf(stderr,"Mapfile contains more than %zu entries\n",(size_t)ENTRIES_MAX);
-          fclose(f);
-          free(map);
-          return 0;
-        }
-        struct mapentry* e = map->entries + map->count++;
-        if(!parseu64(&s,&e->offset)){
-          perror("Failed to parse offset");
-          return 0;
-        }
-        skip_spaces(&s);
-        if(!parseu64(&s,&e->size)){
-          perror("Failed to parse size");
-          return 0;
-        }
-        skip_spaces(&s);
-        char c = *s;
-        switch(c){
-          case '?': e->state=ME_NON_TRIED; break;
-          case '*': e->state=ME_NON_TRIMMED; break;
-          case '/': e->state=ME_NON_SCRAPED; break;
-          case '-': e->state=ME_BAD_SECTOR; break;
-          case '+': e->state=ME_FINISHED; break;
-          default: fprintf(stderr,"Failed to parse map file entry\n"); return 0;
-        }
-      } break;
+    if(count + 1 >= capacity){ // one spare pair for the trailing boundary
+      capacity = capacity ? capacity * 2 : 0x400;
+      uint64_t* tmp = realloc(entries,capacity*2*sizeof(*entries));
+      if(!tmp){
+        perror("failed to allocate map entries");
+        goto error;
+      }
+      entries = tmp;
     }
+    if(count && entry_offset(entries[count*2-2]) > offset)
+      sorted = false;
+    entries[count*2] = entry_pack(offset,state);
+    entries[count*2+1] = size;
+    count++;
   }
-  fclose(f);
-  if(!map_normalize(map)){
-    free(map);
-    return 0;
+
+  if(!sorted)
+    qsort(entries,count,2*sizeof(*entries),load_entry_compare);
+
+  // Entry i is read before anything at or past index 2*i gets written
+  size_t n = 0;
+  uint64_t last_end = 0;
+  enum mapentry_state last_state = ME_NONE;
+  for(size_t i=0; i<count; i++){
+    uint64_t offset = entry_offset(entries[i*2]);
+    enum mapentry_state state = entry_state(entries[i*2]);
+    uint64_t size = entries[i*2+1];
+    if(last_state != ME_NONE && offset < last_end){
+      fprintf(stderr,"Failed to normalize mapfile: overlapping entries not allowed. %"PRIx64" %"PRIx64"-%"PRIx64"\n",last_end,offset,offset+size);
+      goto error;
+    }
+    if(last_state != ME_NONE && offset > last_end)
+      entries[n++] = entry_pack(last_end,ME_NONE);
+    if(state != last_state || offset > last_end)
+      entries[n++] = entry_pack(offset,state);
+    last_end = offset + size;
+    last_state = state;
   }
-  return map;
+  if(last_state != ME_NONE)
+    entries[n++] = entry_pack(last_end,ME_NONE);
+
+  map_build(map,entries,n);
+  free(entries);
+  return true;
+
+error:
+  free(entries);
+  return false;
 }
 
-bool map_move(struct mapfile* map, size_t i, ssize_t n){
-  if( i > map->count ){
-    errno = EINVAL;
+static bool write_all(int fd, const char* data, size_t size){
+  while(size){
+    ssize_t ret = write(fd,data,size);
+    if(ret < 0){
+      if(errno == EINTR)
+        continue;
+      return false;
+    }
+    data += ret;
+    size -= ret;
+  }
+  return true;
+}
+
+static char* journal_path(const char* file){
+  char* path = malloc(strlen(file)+sizeof(".journal"));
+  if(path)
+    sprintf(path,"%s.journal",file);
+  return path;
+}
+
+static uint64_t journal_check(const struct map_journal_record* record){
+  return record->entry ^ record->size ^ MAP_JOURNAL_MAGIC;
+}
+
+static void map_journal_add(struct map_journal* journal, uint64_t start, uint64_t end, enum mapentry_state state){
+  if(journal->count >= journal->capacity){
+    size_t capacity = journal->capacity ? journal->capacity * 2 : 64;
+    struct map_journal_record* pending = realloc(journal->pending,capacity*sizeof(*pending));
+    if(!pending){
+      perror("failed to allocate journal records");
+      exit(4);
+    }
+    journal->pending = pending;
+    journal->capacity = capacity;
+  }
+  struct map_journal_record* record = journal->pending + journal->count++;
+  record->entry = entry_pack(start,state);
+  record->size = end - start;
+  record->check = journal_check(record);
+}
+
+// Applies the updates in the journal belonging to file, if there is one
+static bool map_journal_replay(struct mapfile* map, const char* file){
+  char* path = journal_path(file);
+  if(!path){
+    perror("failed to allocate journal path");
     return false;
   }
-  if( n<0 && map->count < (size_t)-n ){
-    errno = EINVAL;
+  int fd = open(path,O_RDONLY);
+  free(path);
+  if(fd == -1){
+    if(errno == ENOENT)
+      return true;
+    perror("Failed to open journal");
     return false;
   }
-  if( n>0 && ENTRIES_MAX - map->count < (size_t)n ){
-    errno = ENOMEM;
+  size_t size;
+  bool mapped;
+  char* data = file_load(fd,&size,&mapped);
+  close(fd);
+  if(!data){
+    perror("Failed to read journal");
     return false;
   }
-  size_t m = map->count - i;
-  if(m) memmove(map->entries+i+n,map->entries+i,m*sizeof(struct mapentry));
-  map->count += n;
+  size_t count = size / sizeof(struct map_journal_record);
+  for(size_t i=0; i<count; i++){
+    struct map_journal_record record;
+    memcpy(&record,data+i*sizeof(record),sizeof(record));
+    enum mapentry_state state = entry_state(record.entry);
+    uint64_t offset = entry_offset(record.entry);
+    if( record.check != journal_check(&record) || state > ME_FINISHED
+     || MAP_OFFSET_MAX - offset < record.size
+    ){
+      fprintf(stderr,"Journal entry %zu is damaged, ignoring it and everything after it\n",i);
+      break;
+    }
+    map_update(map,offset,offset+record.size,state);
+  }
+  if(count * sizeof(struct map_journal_record) != size)
+    fprintf(stderr,"Ignoring incomplete entry at the end of the journal\n");
+  if(mapped){
+    munmap(data,size);
+  }else{
+    free(data);
+  }
   return true;
 }
 
+static int map_journal_create(const char* file, bool truncate){
+  char* path = journal_path(file);
+  if(!path)
+    return -1;
+  int fd = open(path,O_WRONLY|O_APPEND|O_CREAT|(truncate?O_TRUNC:0),0660);
+  free(path);
+  return fd;
+}
+
+bool map_journal_open(struct mapfile* map, const char* file){
+  int fd = map_journal_create(file,false);
+  if(fd == -1)
+    return false;
+  struct stat st;
+  if(fstat(fd,&st)){
+    close(fd);
+    return false;
+  }
+  if(!map->journal){
+    map->journal = calloc(1,sizeof(struct map_journal));
+    if(!map->journal){
+      close(fd);
+      return false;
+    }
+  }else{
+    close(map->journal->fd);
+  }
+  map->journal->fd = fd;
+  map->journal->size = st.st_size / sizeof(struct map_journal_record);
+  return true;
+}
+
+// Hands the pending records over to the caller, who has to free them
+void map_journal_take(struct mapfile* map, struct map_journal_record** records, size_t* count){
+  struct map_journal* journal = map->journal;
+  *records = journal->pending;
+  *count = journal->count;
+  journal->pending = 0;
+  journal->count = 0;
+  journal->capacity = 0;
+}
+
+bool map_journal_append(struct map_journal* journal, const struct map_journal_record* records, size_t count){
+  if(!count)
+    return true;
+  if(!write_all(journal->fd,(const char*)records,count*sizeof(*records)))
+    return false;
+  if(fdatasync(journal->fd))
+    return false;
+  journal->size += count;
+  return true;
+}
+
+// Truncates the journal once the mapfile contains everything in it, or removes a stale one when not journaling
+bool map_journal_reset(struct map_journal* journal, const char* file){
+  if(!journal){
+    char* path = journal_path(file);
+    if(!path)
+      return false;
+    int ret = unlink(path);
+    free(path);
+    return !ret || errno == ENOENT;
+  }
+  int fd = map_journal_create(file,true);
+  if(fd == -1)
+    return false;
+  close(journal->fd);
+  journal->fd = fd;
+  journal->size = 0;
+  return true;
+}
+
+struct mapfile* map_read(const char* file){
+  struct mapfile* map = calloc(1,sizeof(struct mapfile));
+  if(!map){
+    perror("failed to allocate map file");
+    return 0;
+  }
+  int fd = open(file,O_RDONLY);
+  if(fd == -1){
+    if(errno != ENOENT){
+      perror("Failed to open map file");
+      free(map);
+      return 0;
+    }
+    if(!map_journal_replay(map,file)){
+      map_free(map);
+      return 0;
+    }
+    return map;
+  }
+  size_t size;
+  bool mapped;
+  char* data = file_load(fd,&size,&mapped);
+  close(fd);
+  if(!data){
+    perror("Failed to read map file");
+    free(map);
+    return 0;
+  }
+  bool ok = map_parse(map,data,data+size);
+  if(mapped){
+    munmap(data,size);
+  }else{
+    free(data);
+  }
+  if(!ok || !map_journal_replay(map,file)){
+    map_free(map);
+    return 0;
+  }
+  return map;
+}
+
 bool map_write(struct mapfile* map, int fd){
-  char c[18] = {0};
+  char buffer[0x10000];
   const char txt1[] = {
     "# Mapfile. Created by fuserescue\n"
     "#\n"
@@ -180,142 +885,54 @@ bool map_write(struct mapfile* map, int fd){
     "#      pos        size  status\n"
   };
 
-  if(write(fd,txt1,sizeof(txt1)-1) < 0)
-    return false;
+  size_t n = sizeof(txt1)-1;
+  memcpy(buffer,txt1,n);
 
-  for( size_t i=0,n=map->count; i<n; i++ ){
-    int n;
-    n = u64toa(map->entries[i].offset,c);
-    if(write(fd,c,n) < 0)
-      return false;
-    if(write(fd,"  ",2) < 0)
-      return false;
-    n = u64toa(map->entries[i].size,c);
-    if(write(fd,c,n) < 0)
-      return false;
+  struct map_iterator it;
+  struct mapentry entry;
+  map_iterate(map,&it,0);
+  while(map_next(&it,&entry)){
+    if(sizeof(buffer) - n < 18 + 2 + 18 + 4){
+      if(!write_all(fd,buffer,n))
+        return false;
+      n = 0;
+    }
+    n += u64toa(entry.offset,buffer+n);
+    buffer[n++] = ' ';
+    buffer[n++] = ' ';
+    n += u64toa(entry.size,buffer+n);
     char s;
-    switch(map->entries[i].state){
+    switch(entry.state){
       case ME_FINISHED: s = '+'; break;
       case ME_BAD_SECTOR: s = '-'; break;
       case ME_NON_SCRAPED: s = '/'; break;
       case ME_NON_TRIMMED: s = '*'; break;
       case ME_NON_TRIED: default: s = '?'; break;
     }
-    if(write(fd,(char[]){' ',' ',s,'\n'},4) < 0)
-      return false;
+    memcpy(buffer+n,(char[]){' ',' ',s,'\n'},4);
+    n += 4;
   }
 
-  return true;
+  return write_all(fd,buffer,n);
 }
 
 void map_update(struct mapfile* map, uint64_t start, uint64_t end, enum mapentry_state state){
-  struct mapentry* entries = map->entries;
-  bool inserted = false;
-  size_t i,n;
-  for(i=0,n=map->count; i<n; i++){
-    uint64_t entry_start = entries[i].offset;
-    uint64_t entry_end = entries[i].offset+entries[i].size;
-    if( entry_end < start )
-      continue;
-    if( entry_start > end )
-      break;
-    if(state == entries[i].state){
-      if(start < entry_start){
-        size_t s = entry_start - start;
-        entries[i].offset = start;
-        entries[i].size += s;
-      }
-      if(end > entry_end){
-        entries[i].size += end - entry_end;
-      }
-      inserted=true;
-      i++;
+  if(start >= end)
+    return;
+  if(map->journal)
+    map_journal_add(map->journal,start,end,state);
+  enum mapentry_state after = map_state_at(map,end);
+  while(true){
+    struct map_iterator it;
+    map_iterate(map,&it,start);
+    if(it.depth && iter_offset(&it) < start)
+      iter_advance(&it);
+    if(!it.depth || iter_offset(&it) > end)
       break;
-    }else{
-      if(start <= entry_start && end >= entry_end){
-        entries[i].offset = start;
-        entries[i].size = end-start;
-        entries[i].state = state;
-        inserted=true;
-        i++;
-        break;
-      }
-      if(start <= entry_start){
-        entries[i].offset = end;
-        entries[i].size = entry_end - end;
-        if(!map_move(map,i,1)){
-          perror("map_move failed");
-          exit(4);
-        }
-        entries[i].offset = start;
-        entries[i].size = end - start;
-        entries[i].state = state;
-        inserted=true;
-        i += 2;
-        break;
-      }
-      if(end >= entry_end){
-        entries[i].size = start - entry_start;
-        i++;
-        if(!map_move(map,i,1)){
-          perror("map_move failed");
-          exit(4);
-        }
-        entries[i].offset = start;
-        entries[i].size = end - start;
-        entries[i].state = state;
-        inserted=true;
-        i++;
-        break;
-      }
-      entries[i].size = start - entry_start;
-      i++;
-      if(!map_move(map,i,2)){
-        perror("map_move failed");
-        exit(4);
-      }
-      entries[i].offset = start;
-      entries[i].size = end - start;
-      entries[i].state = state;
-      i++;
-      entries[i].offset = end;
-      entries[i].size = entry_end - end;
-      entries[i].state = entries[i-2].state;
-      inserted=true;
-      i++;
-      break;
-    }
-  }
-  if(!inserted){
-    if(!map_move(map,i,1)){
-      perror("map_move failed");
-      exit(4);
-    }
-    entries[i].offset = start;
-    entries[i].size = end - start;
-    entries[i].state = state;
-    i++;
-  }
-  size_t j = --i + 1;
-  uint64_t e_end = entries[i].offset + entries[i].size;
-  for(n=map->count; j<n; j++){
-    uint64_t entry_start = entries[j].offset;
-    uint64_t entry_end = entries[j].offset+entries[j].size;
-    if( entry_start > e_end )
-      break;
-    if( entry_end > e_end ){
-      if(entries[j].state == state){
-        entries[i].size += entry_end - e_end;
-        e_end = entry_end;
-      }else{
-        entries[j].offset = e_end;
-        entries[j].size = entry_end - e_end;
-        break;
-      }
-    }
-  }
-  if(j > i+1){
-    map_move(map,j,i+1-j);
+    map_erase(map,iter_offset(&it));
   }
+  if(map_state_at(map,start) != state)
+    map_insert(map,start,state);
+  if(after != state)
+    map_insert(map,end,after);
 }
-
@@ -0,0 +1,358 @@
+/*
+fuserescue, an on demand data recovery tool which recovers data on a first access basis.
+Copyright (C) 2018 Daniel Abrecht
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <fuserescue/fuserescue.h>
+#include <fuserescue/metadata.h>
+#include <fuserescue/recover.h>
+#include <fuserescue/scheduler.h>
+#include <fuserescue/range.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Looks for partition tables and file systems in the image, and collects the areas
+ * which are read when listing partitions or mounting the file systems. Everything
+ * needed to find them is recovered right away. The rest is queued all at once
+ * afterwards, so the scheduler can recover it in the order it's located on the disk.
+ */
+
+#define EXT_MAGIC 0xEF53
+#define EXT_INCOMPAT_META_BG 0x10
+#define EXT_INCOMPAT_64BIT 0x80
+#define EXT_RO_COMPAT_GDT_CSUM 0x10
+#define EXT_RO_COMPAT_METADATA_CSUM 0x400
+#define EXT_BG_INODE_UNINIT 0x1
+
+#define EBR_MAX 128
+#define GPT_ENTRIES_MAX 1024
+#define MFT_RECORD_MAX 0x10000
+
+static uint16_t le16(const uint8_t* p){
+  return p[0] | p[1] << 8;
+}
+
+static uint32_t le32(const uint8_t* p){
+  return le16(p) | (uint32_t)le16(p+2) << 16;
+}
+
+static uint64_t le64(const uint8_t* p){
+  return le32(p) | (uint64_t)le32(p+4) << 32;
+}
+
+static void add(struct fuserescue* fr, struct range_list* list, uint64_t start, uint64_t size){
+  if(start >= fr->size)
+    return;
+  if(fr->size - start < size)
+    size = fr->size - start;
+  range_list_add(list,start,start+size);
+}
+
+// Recovers [start, start+size) if necessary and reads it from the image
+static bool fetch(struct fuserescue* fr, uint64_t start, uint64_t size, void* buf){
+  if(start >= fr->size || fr->size - start < size)
+    return false;
+  struct range_list finished = {0};
+  struct range_list to_recover = {0};
+  scheduler_recover(fr,(struct range){start,start+size},PRIORITY_METADATA);
+  fr_lock(fr);
+  bool ok = classify_range(fr,start,start+size,&finished,&to_recover) && !to_recover.count;
+  pthread_mutex_unlock(&fr->lock);
+  range_list_clear(&finished);
+  range_list_clear(&to_recover);
+  if(ok)
+    read_image(fr,buf,start,start+size);
+  return ok;
+}
+
+// size is that of the partition, or of the rest of the image, which the file system has to fit in
+static bool scan_ext(struct fuserescue* fr, struct range_list* list, uint64_t start, uint64_t size, const uint8_t* sb){
+  if(le16(sb+56) != EXT_MAGIC || le32(sb+24) > 6)
+    return false;
+  uint64_t bs = 1024 << le32(sb+24);
+  uint32_t incompat = le32(sb+96);
+  uint32_t ro_compat = le32(sb+100);
+  uint64_t blocks = le32(sb+4);
+  if(incompat & EXT_INCOMPAT_64BIT)
+    blocks |= (uint64_t)le32(sb+0x150) << 32;
+  uint64_t first = le32(sb+20);
+  uint64_t bpg = le32(sb+32);
+  uint64_t ipg = le32(sb+40);
+  uint64_t inode_size = le32(sb+76) ? le16(sb+88) : 128;
+  uint64_t desc_size = incompat & EXT_INCOMPAT_64BIT ? le16(sb+254) : 32;
+  if(!bpg || blocks <= first || desc_size < 32)
+    return false;
+  // Don't let a damaged superblock make us recover far more than the file system can have
+  if(bpg < 256 || bpg > 8 * bs || blocks > size / bs)
+    return false;
+  if(fr->loglevel >= LOGLEVEL_INFO)
+    printf("metadata: ext file system at 0x%"PRIx64"\n",start);
+  add(fr,list,start,2048);
+  // With meta_bg, the group descriptors are spread over the file system
+  if(incompat & EXT_INCOMPAT_META_BG)
+    return true;
+  uint64_t groups = (blocks - first + bpg - 1) / bpg;
+  uint64_t gdt = start + (first + 1) * bs;
+  uint8_t* desc = malloc(groups * desc_size);
+  if(!desc){
+    perror("failed to allocate group descriptors");
+    return true;
+  }
+  add(fr,list,gdt,groups*desc_size);
+  if(fetch(fr,gdt,groups*desc_size,desc)){
+    for(uint64_t g=0; g<groups; g++){
+      const uint8_t* d = desc + g * desc_size;
+      bool hi = desc_size >= 64;
+      uint64_t block_bitmap = le32(d) | (hi ? (uint64_t)le32(d+0x20) << 32 : 0);
+      uint64_t inode_bitmap = le32(d+4) | (hi ? (uint64_t)le32(d+0x24) << 32 : 0);
+      uint64_t inode_table = le32(d+8) | (hi ? (uint64_t)le32(d+0x28) << 32 : 0);
+      uint64_t unused = le16(d+0x1C) | (hi ? (uint64_t)le16(d+0x32) << 16 : 0);
+      // Only the part of the inode table which is in use is of interest
+      uint64_t used = ipg;
+      if(ro_compat & (EXT_RO_COMPAT_GDT_CSUM|EXT_RO_COMPAT_METADATA_CSUM))
+        used = le16(d+0x12) & EXT_BG_INODE_UNINIT || unused > ipg ? 0 : ipg - unused;
+      add(fr,list,start+block_bitmap*bs,bs);
+      add(fr,list,start+inode_bitmap*bs,bs);
+      add(fr,list,start+inode_table*bs,used*inode_size);
+    }
+  }
+  free(desc);
+  return true;
+}
+
+static bool scan_fat(struct fuserescue* fr, struct range_list* list, uint64_t start, const uint8_t* b){
+  uint64_t bps = le16(b+11);
+  uint64_t spc = b[13];
+  uint64_t reserved = le16(b+14);
+  uint64_t fats = b[16];
+  uint64_t root_entries = le16(b+17);
+  uint64_t fat_size = le16(b+22) ? le16(b+22) : le32(b+36);
+  if( (b[0] != 0xEB && b[0] != 0xE9) || le16(b+510) != 0xAA55
+   || bps < 512 || bps > 4096 || (bps & (bps-1))
+   || !spc || (spc & (spc-1)) || !reserved || !fats || fats > 2 || !fat_size
+  ) return false;
+  if(fr->loglevel >= LOGLEVEL_INFO)
+    printf("metadata: FAT file system at 0x%"PRIx64"\n",start);
+  // The reserved sectors, the FATs and, except for FAT32, the root directory
+  add(fr,list,start,(reserved+fats*fat_size)*bps+root_entries*32);
+  return true;
+}
+
+// Applies the update sequence of an NTFS record, which protects the end of each sector
+static bool ntfs_fixup(uint8_t* record, uint64_t size){
+  uint64_t usa = le16(record+4);
+  uint64_t count = le16(record+6);
+  if(!count || usa + count * 2 > size || (count - 1) * 512 > size)
+    return false;
+  for(uint64_t i=1; i<count; i++){
+    uint8_t* end = record + i * 512 - 2;
+    if(le16(end) != le16(record+usa))
+      return false;
+    memcpy(end,record+usa+i*2,2);
+  }
+  return true;
+}
+
+// Adds the extents of the $MFT data attribute in record, returns false if there is none
+static bool ntfs_mft_runs(struct fuserescue* fr, struct range_list* list, uint64_t start, uint64_t cluster, const uint8_t* record, uint64_t size){
+  uint64_t pos = le16(record+0x14);
+  while(pos + 16 <= size){
+    const uint8_t* a = record + pos;
+    uint32_t type = le32(a);
+    uint32_t length = le32(a+4);
+    if(type == 0xFFFFFFFF || length < 16 || length > size - pos)
+      return false;
+    if(type == 0x80 && a[8] && length >= 0x22){
+      uint64_t run = le16(a+0x20);
+      uint64_t lcn = 0;
+      while(run < length && a[run]){
+        unsigned lbytes = a[run] & 0xF;
+        unsigned obytes = a[run] >> 4;
+        if(!lbytes || lbytes > 8 || obytes > 8 || run + 1 + lbytes + obytes > length)
+          break;
+        uint64_t len = 0;
+        for(unsigned i=0; i<lbytes; i++)
+          len |= (uint64_t)a[run+1+i] << i*8;
+        if(obytes){ // No offset means the run is sparse
+          uint64_t offset = 0;
+          for(unsigned i=0; i<obytes; i++)
+            offset |= (uint64_t)a[run+1+lbytes+i] << i*8;
+          if(obytes < 8 && a[run+lbytes+obytes] & 0x80)
+            offset |= ~UINT64_C(0) << obytes*8;
+          lcn += offset;
+          add(fr,list,start+lcn*cluster,len*cluster);
+        }
+        run += 1 + lbytes + obytes;
+      }
+      return true;
+    }
+    pos += length;
+  }
+  return false;
+}
+
+static bool scan_ntfs(struct fuserescue* fr, struct range_list* list, uint64_t start, const uint8_t* b){
+  if(memcmp(b+3,"NTFS    ",8))
+    return false;
+  uint64_t bps = le16(b+11);
+  uint64_t spc = b[13] > 0x80 ? UINT64_C(1) << (256 - b[13]) : b[13];
+  uint64_t cluster = bps * spc;
+  int8_t rc = (int8_t)b[0x40];
+  if(!cluster || rc < -16)
+    return false;
+  uint64_t record_size = rc > 0 ? rc * cluster : UINT64_C(1) << -rc;
+  if(!record_size || record_size > MFT_RECORD_MAX)
+    return false;
+  if(fr->loglevel >= LOGLEVEL_INFO)
+    printf("metadata: NTFS file system at 0x%"PRIx64"\n",start);
+  uint64_t mft = start + le64(b+0x30) * cluster;
+  add(fr,list,start,bps);
+  add(fr,list,start+le64(b+0x38)*cluster,4*record_size);
+  uint8_t* record = malloc(record_size);
+  if(!record){
+    perror("failed to allocate MFT record");
+    return true;
+  }
+  // The MFT describes where the rest of it is, the first few records are always contiguous
+  if( !fetch(fr,mft,record_size,record) || memcmp(record,"FILE",4)
+   || !ntfs_fixup(record,record_size) || !ntfs_mft_runs(fr,list,start,cluster,record,record_size)
+  ) add(fr,list,mft,16*record_size);
+  free(record);
+  return true;
+}
+
+// Looks for a file system in [start, start+size), the size is cut off at the end of the image
+static bool scan_fs(struct fuserescue* fr, struct range_list* list, uint64_t start, uint64_t size){
+  uint8_t b[2048];
+  if(!fetch(fr,start,sizeof(b),b))
+    return false;
+  if(size > fr->size - start)
+    size = fr->size - start;
+  return scan_ntfs(fr,list,start,b) || scan_fat(fr,list,start,b) || scan_ext(fr,list,start,size,b+1024);
+}
+
+static bool scan_gpt(struct fuserescue* fr, struct range_list* list){
+  uint8_t h[512];
+  for(uint64_t ss=512; ss<=4096; ss*=8){
+    if(!fetch(fr,ss,sizeof(h),h) || memcmp(h,"EFI PART",8))
+      continue;
+    uint64_t entries = le64(h+72) * ss;
+    uint64_t count = le32(h+80);
+    uint64_t entry_size = le32(h+84);
+    if(count > GPT_ENTRIES_MAX || entry_size < 128 || entry_size > 4096)
+      return false;
+    if(fr->loglevel >= LOGLEVEL_INFO)
+      printf("metadata: GPT with %"PRIu64" entries\n",count);
+    add(fr,list,ss,ss);
+    add(fr,list,entries,count*entry_size);
+    add(fr,list,le64(h+32)*ss,ss); // backup header
+    uint8_t* table = malloc(count * entry_size);
+    if(!table){
+      perror("failed to allocate partition table");
+      return true;
+    }
+    if(fetch(fr,entries,count*entry_size,table)){
+      static const uint8_t unused[16];
+      for(uint64_t i=0; i<count; i++){
+        const uint8_t* e = table + i * entry_size;
+        if(memcmp(e,unused,16))
+          scan_fs(fr,list,le64(e+32)*ss,(le64(e+40)-le64(e+32)+1)*ss);
+      }
+    }
+    free(table);
+    return true;
+  }
+  return false;
+}
+
+static bool is_extended(uint8_t type){
+  return type == 0x05 || type == 0x0F || type == 0x85;
+}
+
+static void scan_ebr(struct fuserescue* fr, struct range_list* list, uint64_t extended){
+  uint64_t ebr = extended;
+  for(int i=0; i<EBR_MAX; i++){
+    uint8_t b[512];
+    if(!fetch(fr,ebr,sizeof(b),b) || le16(b+510) != 0xAA55)
+      return;
+    add(fr,list,ebr,sizeof(b));
+    if(b[446+4])
+      scan_fs(fr,list,ebr+(uint64_t)le32(b+446+8)*512,(uint64_t)le32(b+446+12)*512);
+    if(!is_extended(b[462+4]))
+      return;
+    ebr = extended + (uint64_t)le32(b+462+8)*512;
+  }
+}
+
+static void scan_mbr(struct fuserescue* fr, struct range_list* list){
+  uint8_t b[512];
+  if(!fetch(fr,0,sizeof(b),b) || le16(b+510) != 0xAA55)
+    return;
+  add(fr,list,0,sizeof(b));
+  for(int i=0; i<4; i++){
+    const uint8_t* e = b + 446 + i * 16;
+    uint64_t start = (uint64_t)le32(e+8) * 512;
+    if(!e[4] || !le32(e+12) || e[4] == 0xEE)
+      continue;
+    if(is_extended(e[4])){
+      scan_ebr(fr,list,start);
+    }else{
+      scan_fs(fr,list,start,(uint64_t)le32(e+12)*512);
+    }
+  }
+}
+
+void* metadata_thread(void* param){
+  struct fuserescue* fr = param;
+  fr_lock(fr);
+  while(!fr->exiting){
+    if(!fr->metadata_scan){
+      pthread_cond_wait(&fr->metadata_cond,&fr->lock);
+      continue;
+    }
+    pthread_mutex_unlock(&fr->lock);
+    struct range_list list = {0};
+    // An image of a single file system doesn't have a partition table
+    if(!scan_fs(fr,&list,0,fr->size) && !scan_gpt(fr,&list))
+      scan_mbr(fr,&list);
+    range_list_sort(&list);
+    uint64_t total = 0;
+    for(size_t i=0; i<list.count; i++)
+      total += list.range[i].end - list.range[i].start;
+    printf("metadata: recovering %zu areas, 0x%"PRIx64" bytes\n",list.count,total);
+    struct recover_job** jobs = calloc(list.count,sizeof(*jobs));
+    if(list.count && !jobs){
+      perror("failed to allocate recovery jobs");
+      exit(4);
+    }
+    for(size_t i=0; i<list.count; i++)
+      jobs[i] = scheduler_submit(fr,list.range[i],PRIORITY_METADATA,true);
+    for(size_t i=0; i<list.count; i++)
+      scheduler_wait(fr,jobs[i]);
+    free(jobs);
+    range_list_clear(&list);
+    puts("metadata: done");
+    pthread_cond_signal(&fr->checkpoint_cond);
+    fr_lock(fr);
+    fr->metadata_scan = false;
+    pthread_cond_signal(&fr->sweep_cond);
+  }
+  pthread_mutex_unlock(&fr->lock);
+  return 0;
+}
@@ -0,0 +1,73 @@
+/*
+fuserescue, an on demand data recovery tool which recovers data on a first access basis.
+Copyright (C) 2018 Daniel Abrecht
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <fuserescue/range.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// Appends a range, extending the last one if they are adjacent
+void range_list_add(struct range_list* list, uint64_t start, uint64_t end){
+  if(start >= end)
+    return;
+  if(list->count && list->range[list->count-1].end == start){
+    list->range[list->count-1].end = end;
+    return;
+  }
+  if(list->count >= list->capacity){
+    size_t capacity = list->capacity ? list->capacity * 2 : 16;
+    struct range* range = realloc(list->range,capacity*sizeof(*range));
+    if(!range){
+      perror("failed to allocate range list");
+      exit(4);
+    }
+    list->range = range;
+    list->capacity = capacity;
+  }
+  list->range[list->count++] = (struct range){start,end};
+}
+
+static int range_compare(const void* a, const void* b){
+  const struct range* x = a;
+  const struct range* y = b;
+  return x->start < y->start ? -1 : x->start > y->start;
+}
+
+// Sorts the ranges by their start and merges those which overlap or are adjacent
+void range_list_sort(struct range_list* list){
+  if(!list->count)
+    return;
+  qsort(list->range,list->count,sizeof(*list->range),range_compare);
+  size_t n = 0;
+  for(size_t i=1; i<list->count; i++){
+    if(list->range[i].start <= list->range[n].end){
+      if(list->range[n].end < list->range[i].end)
+        list->range[n].end = list->range[i].end;
+    }else{
+      list->range[++n] = list->range[i];
+    }
+  }
+  list->count = n + 1;
+}
+
+void range_list_clear(struct range_list* list){
+  free(list->range);
+  list->range = 0;
+  list->count = 0;
+  list->capacity = 0;
+}
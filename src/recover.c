@@ -0,0 +1,489 @@
+/*
+fuserescue, an on demand data recovery tool which recovers data on a first access basis.
+Copyright (C) 2018 Daniel Abrecht
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <fuserescue/fuserescue.h>
+#include <fuserescue/recover.h>
+#include <fuserescue/scheduler.h>
+#include <fuserescue/map.h>
+#include <fuserescue/cache.h>
+#include <errno.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Sorts the parts of [start, end) into ranges which are already recovered and ranges
+ * which still have to be recovered. Returns false if some parts may not be recovered
+ * because of recover_states. fr->lock must be held.
+ */
+bool classify_range(
+  struct fuserescue* fr,
+  uint64_t start, uint64_t end,
+  struct range_list* finished,
+  struct range_list* to_recover
+){
+  bool ok = true;
+  uint64_t pos = start;
+  struct map_iterator it;
+  struct mapentry entry;
+  map_iterate(fr->map,&it,start);
+  while(pos < end && map_next(&it,&entry)){
+    if(entry.offset >= end)
+      break;
+    if(entry.offset + entry.size <= pos)
+      continue;
+    if(entry.offset > pos)
+      range_list_add(to_recover,pos,entry.offset);
+    uint64_t overlap_start = pos > entry.offset ? pos : entry.offset;
+    uint64_t overlap_end = end > entry.offset+entry.size ? entry.offset+entry.size : end;
+    if(entry.state == ME_FINISHED){
+      range_list_add(finished,overlap_start,overlap_end);
+    }else if( (1lu<<entry.state) & fr->recover_states ){
+      range_list_add(to_recover,overlap_start,overlap_end);
+    }else{
+      ok = false;
+    }
+    pos = overlap_end;
+  }
+  if(pos < end)
+    range_list_add(to_recover,pos,end);
+  return ok;
+}
+
+/*
+ * Changes the state of [start, end) in the map. Only finished data is cached, by the block cache
+ * and maybe by the kernel, so parts which were finished before are dropped from both.
+ * fr->lock must be held.
+ */
+static void mark(struct fuserescue* fr, uint64_t start, uint64_t end, enum mapentry_state state){
+  if(state != ME_FINISHED){
+    struct range_list finished = {0};
+    struct range_list rest = {0};
+    classify_range(fr,start,end,&finished,&rest);
+    for(size_t i=0; i<finished.count; i++){
+      struct range r = finished.range[i];
+      cache_invalidate(&fr->cache,r.start,r.end);
+      if(fr->kernel_cache)
+        range_list_add(&fr->stale,r.start,r.end);
+    }
+    if(fr->kernel_cache && finished.count)
+      pthread_cond_signal(&fr->stale_cond);
+    range_list_clear(&finished);
+    range_list_clear(&rest);
+  }
+  map_update(fr->map,start,end,state);
+}
+
+void read_image(struct fuserescue* fr, char* buf, uint64_t start, uint64_t end){
+  while(start < end){
+    ssize_t ret = pread(fr->outfile, buf, end - start, start);
+    if(ret < 0){
+      if(errno == EINTR)
+        continue;
+      perror("failed to read from outfile");
+      exit(2);
+    }
+    if(!ret)
+      break;
+    buf += ret;
+    start += ret;
+  }
+}
+
+// Direct io needs sector aligned reads, so read the whole sectors but only use the requested part
+static void block_read(struct fuserescue* fr, struct device_read* rd, char* readbuffer, uint64_t start, size_t size){
+  uint64_t sector_size = fr->sector_size;
+  uint64_t offset = fr->source[0].offset;
+  uint64_t aligned_start = (offset + start) / sector_size * sector_size;
+  uint64_t aligned_end = (offset + start + size + sector_size - 1) / sector_size * sector_size;
+  *rd = (struct device_read){
+    .offset = aligned_start,
+    .size = aligned_end - aligned_start,
+    .buf = readbuffer
+  };
+}
+
+/*
+ * Takes the result of a read of [start, start+size) set up by block_read. Whatever could be
+ * read is written to the image and marked as finished. Areas which couldn't be read are marked
+ * as nonscraped, or nontried if the read timed out, so it's tried again later. Returns the
+ * number of bytes read, or -1 with errno set.
+ */
+static ssize_t block_store(struct fuserescue* fr, const struct device_read* rd, uint64_t start, size_t size){
+  size_t lead = fr->source[0].offset + start - rd->offset;
+  ssize_t ret = rd->result;
+  if(ret <= (ssize_t)lead){
+    int err = ret < 0 ? rd->error : EIO;
+    fr_lock(fr);
+    mark(fr,start,start+size,err == ETIMEDOUT ? ME_NON_TRIED : ME_NON_SCRAPED);
+    fr->unsaved++;
+    pthread_mutex_unlock(&fr->lock);
+    errno = err;
+    return -1;
+  }
+  ret -= lead;
+  if((size_t)ret > size)
+    ret = size;
+  const char* buf = rd->buf + lead;
+  size_t wcount = 0;
+  while(wcount < (size_t)ret){
+    ssize_t w = pwrite(fr->outfile,buf+wcount,ret-wcount,start+wcount);
+    if(w < 0){
+      if(errno == EINTR)
+        continue;
+      perror("writing to outfile failed");
+      exit(2);
+    }
+    wcount += w;
+  }
+  fr_lock(fr);
+  mark(fr,start,start+ret,ME_FINISHED);
+  if(fr->source_count > 1)
+    map_update(fr->source[rd->source].recovered,start,start+ret,ME_FINISHED);
+  stats_add(&fr->stats.bytes_recovered,ret);
+  fr->unsaved++;
+  uint64_t generation;
+  bool cached = cache_enabled(&fr->cache,&generation);
+  pthread_mutex_unlock(&fr->lock);
+  if(cached)
+    cache_write(fr,buf,(struct range){start,start+ret},generation);
+  return ret;
+}
+
+// Tries to recover [start, start+size), see block_store
+static ssize_t recover_block(struct fuserescue* fr, char* readbuffer, uint64_t start, size_t size){
+  struct device_read rd;
+  block_read(fr,&rd,readbuffer,start,size);
+  source_read(fr,&rd,1);
+  return block_store(fr,&rd,start,size);
+}
+
+/*
+ * Narrows down a failed read of [start, start+size) by bisection. Each step reads the half
+ * at the side the read came from. If that works, the bad part is in the other half, otherwise
+ * the other half is left for later. If a read times out, everything left is left for later.
+ * This ends at the first bad sector, or the last one when going backward, and everything
+ * before it is recovered. Returns how much of the range was dealt with, counted from the
+ * side the read came from, or -1 if a read failed unexpectedly.
+ */
+static ssize_t bisect_block(struct fuserescue* fr, char* readbuffer, uint64_t start, size_t size, bool backward){
+  uint64_t sector_size = fr->sector_size;
+  uint64_t lo = start, hi = start + size; // Always contains something unreadable
+  while(hi - lo > sector_size){
+    size_t half = ((hi - lo) / 2 + sector_size - 1) / sector_size * sector_size;
+    uint64_t s = backward ? hi - half : lo;
+    ssize_t ret = recover_block(fr,readbuffer,s,half);
+    if(ret < 0 && errno == ETIMEDOUT){
+      // Don't make things worse, leave the rest for later
+      fr_lock(fr);
+      mark(fr,lo,hi,ME_NON_TRIED);
+      pthread_mutex_unlock(&fr->lock);
+      return size;
+    }
+    if(ret < 0){
+      if(errno != EIO)
+        return -1;
+      fr_lock(fr);
+      if(backward){
+        mark(fr,lo,s,ME_NON_TRIED);
+        lo = s;
+      }else{
+        mark(fr,s+half,hi,ME_NON_TRIED);
+        hi = s + half;
+      }
+      pthread_mutex_unlock(&fr->lock);
+    }else if(backward){
+      hi = s;
+    }else{
+      lo = s + ret;
+    }
+  }
+  return backward ? start + size - lo : hi - start;
+}
+
+/*
+ * Recovers the ranges in the list. It starts at the front and goes forward until a read fails,
+ * then continues at the back going backward until a read fails, and so on. In adaptive mode,
+ * the size of the reads doubles after each successful read, up to the blocksize, and drops to
+ * the sector size after a failed one, which is then bisected. Going forward, as many reads as
+ * the device allows are done at once. Returns false if anything couldn't be recovered.
+ */
+static bool recover_ranges(struct fuserescue* fr, struct range_list* list, char* readbuffer, uint64_t blocksize){
+  bool ok = true;
+  size_t slot_size = recover_buffer_size(fr,blocksize) / fr->depth;
+  fr_lock(fr);
+  bool adaptive = fr->adaptive;
+  uint64_t read_size = adaptive && fr->read_size ? fr->read_size : blocksize;
+  pthread_mutex_unlock(&fr->lock);
+  uint64_t min_size = blocksize < fr->sector_size ? blocksize : fr->sector_size;
+  if(read_size > blocksize)
+    read_size = blocksize;
+  enum { FORWARD, BACKWARD } direction = FORWARD;
+  for(size_t i=0,j=list->count; i<j;){
+    if(direction == FORWARD){
+      struct range* r = &list->range[i];
+      if(fr->loglevel >= LOGLEVEL_INFO)
+        printf("trying to recover %"PRIx64"+%"PRIx64" - %"PRIx64"\n", fr->source[0].offset,r->start,r->end);
+      while(r->start < r->end){
+        // Reads are aligned to the blocksize, and to the read size. Several may be in flight at once.
+        struct device_read reads[QUEUE_DEPTH_MAX];
+        size_t sizes[QUEUE_DEPTH_MAX];
+        size_t n = 0;
+        for(uint64_t pos=r->start, size=read_size; n<fr->depth && pos<r->end; n++){
+          size_t m = blocksize - pos % blocksize;
+          if(m > size - pos % size)
+            m = size - pos % size;
+          if(m > r->end - pos)
+            m = r->end - pos;
+          block_read(fr,&reads[n],readbuffer+n*slot_size,pos,m);
+          sizes[n] = m;
+          pos += m;
+          if(adaptive && size < blocksize)
+            size = size * 2 > blocksize ? blocksize : size * 2;
+        }
+        source_read(fr,reads,n);
+        for(size_t k=0; k<n; k++){
+          size_t m = sizes[k];
+          ssize_t ret = block_store(fr,&reads[k],r->start,m);
+          if(ret < 0){
+            int err = errno;
+            ok = false;
+            if(err != EIO && err != ETIMEDOUT){
+              perror("read failed in an unexpected way");
+              goto end;
+            }
+            perror("forward read from infile failed");
+            if(adaptive){
+              read_size = min_size;
+              if(err == EIO && m > fr->sector_size && (ret = bisect_block(fr,readbuffer,r->start,m,false)) < 0){
+                perror("read failed in an unexpected way");
+                goto end;
+              }
+              if(ret > 0)
+                m = ret;
+            }
+            r->start += m;
+            fr_lock(fr);
+            mark(fr,r->start,r->end,ME_NON_TRIED);
+            pthread_mutex_unlock(&fr->lock);
+            direction = BACKWARD;
+            goto next;
+          }
+          if(adaptive && (size_t)ret == m && read_size < blocksize)
+            read_size = read_size * 2 > blocksize ? blocksize : read_size * 2;
+          r->start += ret;
+          if((size_t)ret < m) // Short read, the reads after it don't line up
+            break;
+        }
+      }
+      i++;
+    }else{
+      struct range* r = &list->range[j-1];
+      if(fr->loglevel >= LOGLEVEL_INFO)
+        printf("trying to recover %"PRIx64"+%"PRIx64" - %"PRIx64"\n", fr->source[0].offset,r->start,r->end);
+      while(r->start < r->end){
+        size_t m = r->end % blocksize;
+        if(!m)
+          m = blocksize;
+        if(m > read_size){
+          m = r->end % read_size;
+          if(!m)
+            m = read_size;
+        }
+        if(m > r->end - r->start)
+          m = r->end - r->start;
+        ssize_t ret = recover_block(fr,readbuffer,r->end-m,m);
+        if(ret < 0){
+          int err = errno;
+          ok = false;
+          if(err != EIO && err != ETIMEDOUT){
+            perror("read failed in an unexpected way");
+            goto end;
+          }
+          perror("backward read from infile failed");
+          if(adaptive){
+            read_size = min_size;
+            if(err == EIO && m > fr->sector_size && (ret = bisect_block(fr,readbuffer,r->end-m,m,true)) < 0){
+              perror("read failed in an unexpected way");
+              goto end;
+            }
+            if(ret > 0)
+              m = ret;
+          }
+          r->end -= m;
+          fr_lock(fr);
+          mark(fr,r->start,r->end,ME_NON_TRIED);
+          pthread_mutex_unlock(&fr->lock);
+          direction = FORWARD;
+          goto next;
+        }
+        if((size_t)ret < m) // Short read at the end of the file to recover
+          ok = false;
+        else if(adaptive && read_size < blocksize)
+          read_size = read_size * 2 > blocksize ? blocksize : read_size * 2;
+        r->end -= m;
+      }
+      j--;
+    }
+    next:;
+  }
+end:
+  if(adaptive){
+    fr_lock(fr);
+    fr->read_size = read_size;
+    pthread_mutex_unlock(&fr->lock);
+  }
+  return ok;
+}
+
+// How large the buffer passed to recover_range and recover_slice has to be
+size_t recover_buffer_size(struct fuserescue* fr, uint64_t blocksize){
+  // Enough for a whole block plus the partial sectors on both ends, for each read in flight
+  size_t slot_size = (blocksize + 2 * fr->sector_size + BUFFER_ALIGNMENT - 1) / BUFFER_ALIGNMENT * BUFFER_ALIGNMENT;
+  return slot_size * fr->depth;
+}
+
+/*
+ * Recovers whatever may be recovered in [r.start, r.end), as a fuse read would need it.
+ * Returns false if anything couldn't be recovered.
+ */
+bool recover_range(struct fuserescue* fr, char* readbuffer, struct range r, uint64_t blocksize){
+  struct range_list finished = {0};
+  struct range_list to_recover = {0};
+  fr_lock(fr);
+  bool ok = classify_range(fr,r.start,r.end,&finished,&to_recover);
+  pthread_mutex_unlock(&fr->lock);
+  if(!recover_ranges(fr,&to_recover,readbuffer,blocksize))
+    ok = false;
+  range_list_clear(&finished);
+  range_list_clear(&to_recover);
+  return ok;
+}
+
+/*
+ * Recovers what may be recovered in r, which must not be larger than a block, for
+ * background work. Returns false as soon as a read fails.
+ */
+bool recover_slice(struct fuserescue* fr, char* readbuffer, struct range r, const char* what){
+  bool ok = true;
+  struct range_list finished = {0};
+  struct range_list to_recover = {0};
+  fr_lock(fr);
+  classify_range(fr,r.start,r.end,&finished,&to_recover);
+  pthread_mutex_unlock(&fr->lock);
+  for(size_t i=0; ok && i<to_recover.count; i++){
+    struct range* t = &to_recover.range[i];
+    if(fr->loglevel >= LOGLEVEL_INFO)
+      printf("%s %"PRIx64"+%"PRIx64" - %"PRIx64"\n", what,fr->source[0].offset,t->start,t->end);
+    if(recover_block(fr,readbuffer,t->start,t->end-t->start) < (ssize_t)(t->end-t->start))
+      ok = false;
+  }
+  range_list_clear(&finished);
+  range_list_clear(&to_recover);
+  return ok;
+}
+
+// Queues a speculative recovery of the window after a demand read ending at start
+void fr_readahead(struct fuserescue* fr, uint64_t start){
+  fr_lock(fr);
+  uint64_t end = fr->size - start < fr->readahead ? fr->size : start + fr->readahead;
+  pthread_mutex_unlock(&fr->lock);
+  if(start < end)
+    scheduler_submit(fr,(struct range){start,end},PRIORITY_READAHEAD,false);
+}
+
+// Finds the first nontried area at or after pos. fr->lock must be held.
+static bool find_nontried(struct fuserescue* fr, uint64_t pos, struct range* r){
+  struct map_iterator it;
+  struct mapentry entry;
+  map_iterate(fr->map,&it,pos);
+  while(pos < fr->size){
+    bool more = map_next(&it,&entry);
+    if(more && entry.offset + entry.size <= pos)
+      continue;
+    if(!more || entry.offset > pos){
+      // Areas missing in the map haven't been tried yet either
+      r->start = pos;
+      r->end = more && entry.offset < fr->size ? entry.offset : fr->size;
+      return true;
+    }
+    uint64_t end = entry.offset + entry.size < fr->size ? entry.offset + entry.size : fr->size;
+    if(entry.state == ME_NON_TRIED){
+      r->start = pos;
+      r->end = end;
+      return true;
+    }
+    pos = end;
+  }
+  return false;
+}
+
+/*
+ * Recovers nontried areas one block at a time while no fuse read is in progress. The
+ * scheduler puts demand reads first anyway, this avoids seeking between them. After a
+ * failed read, it skips ahead, twice as far as last time if that failed too. Skipped
+ * areas are tried the next time around. Areas where the read timed out are marked as
+ * nontrimmed, otherwise a sector which always hangs would be tried over and over.
+ */
+void* sweep_thread(void* param){
+  struct fuserescue* fr = param;
+  uint64_t skip = 0;
+  fr_lock(fr);
+  while(!fr->exiting){
+    struct range r;
+    if( !fr->sweep || !fr->allowed || !((1lu<<ME_NON_TRIED) & fr->recover_states)
+     || fr->demand || fr->metadata_scan
+    ){
+      pthread_cond_wait(&fr->sweep_cond,&fr->lock);
+      continue;
+    }
+    if(!find_nontried(fr,fr->sweep_pos,&r) && !find_nontried(fr,0,&r)){
+      puts("sweep finished, nothing left to try");
+      fr->sweep = false;
+      continue;
+    }
+    uint64_t blocksize = fr->blocksize;
+    pthread_mutex_unlock(&fr->lock);
+    uint64_t end = r.start + blocksize - r.start % blocksize;
+    if(end > r.end)
+      end = r.end;
+    bool ok = scheduler_recover(fr,(struct range){r.start,end},PRIORITY_SWEEP);
+    if(ok){
+      skip = 0;
+    }else{
+      skip = skip ? skip * 2 : blocksize;
+      if(skip > SWEEP_SKIP_MAX)
+        skip = SWEEP_SKIP_MAX;
+    }
+    fr_lock(fr);
+    if(!ok){
+      // Whatever is still nontried timed out
+      for(uint64_t pos=r.start; pos<end && find_nontried(fr,pos,&r) && r.start<end; pos=r.end){
+        if(r.end > end)
+          r.end = end;
+        mark(fr,r.start,r.end,ME_NON_TRIMMED);
+        fr->unsaved++;
+      }
+    }
+    fr->sweep_pos = ok || fr->size - end < skip ? end : end + skip;
+  }
+  pthread_mutex_unlock(&fr->lock);
+  return 0;
+}
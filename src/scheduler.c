@@ -0,0 +1,237 @@
+/*
+fuserescue, an on demand data recovery tool which recovers data on a first access basis.
+Copyright (C) 2018 Daniel Abrecht
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <fuserescue/fuserescue.h>
+#include <fuserescue/scheduler.h>
+#include <fuserescue/recover.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * All reads from the file to recover go through a single thread, which picks what to
+ * recover next. Demand reads come first, then metadata, readahead and the sweep. Within
+ * the same priority, jobs are taken in ascending order starting at the end of the last
+ * read, wrapping around at the end, so the device seeks as little as possible. Demand
+ * reads next to each other are recovered together. Everything else is recovered one
+ * block at a time, so a demand read never has to wait for more than a block.
+ */
+
+static const char* const priority_name[PRIORITY_COUNT] = {
+  [PRIORITY_DEMAND] = "demand",
+  [PRIORITY_METADATA] = "metadata",
+  [PRIORITY_READAHEAD] = "readahead",
+  [PRIORITY_SWEEP] = "sweep"
+};
+
+static void job_finish(struct fuserescue* fr, struct recover_job* job, bool ok){
+  struct recover_job** it = &fr->queue;
+  while(*it != job)
+    it = &(*it)->next;
+  *it = job->next;
+  if(job->detached){
+    free(job);
+  }else{
+    job->done = true;
+    job->ok = ok;
+    pthread_cond_broadcast(&fr->completed_cond);
+  }
+}
+
+/*
+ * Queues a range to be recovered. If wait is false, nothing waits for the job, it may be
+ * merged with a detached job of the same priority it overlaps or touches, and null is
+ * returned. Otherwise, the job has to be passed to scheduler_wait.
+ */
+struct recover_job* scheduler_submit(struct fuserescue* fr, struct range r, enum recover_priority priority, bool wait){
+  struct recover_job* job = calloc(1,sizeof(*job));
+  if(!job){
+    perror("failed to allocate recovery job");
+    exit(4);
+  }
+  job->range = r;
+  job->priority = priority;
+  job->detached = !wait;
+  fr_lock(fr);
+  if(fr->exiting){
+    job->done = true;
+    pthread_mutex_unlock(&fr->lock);
+    if(!wait){
+      free(job);
+      return 0;
+    }
+    return job;
+  }
+  size_t count = 0;
+  struct recover_job* oldest = 0;
+  for(struct recover_job* it=fr->queue; it; it=it->next){
+    if(!wait && it->detached && !it->running && it->priority == priority){
+      if(it->range.start <= r.end && it->range.end >= r.start){
+        if(it->range.start > r.start)
+          it->range.start = r.start;
+        if(it->range.end < r.end)
+          it->range.end = r.end;
+        free(job);
+        pthread_mutex_unlock(&fr->lock);
+        return 0;
+      }
+      oldest = it; // new jobs go first, so the last one found is the oldest
+      count++;
+    }
+  }
+  // The oldest speculative work which was never started gets dropped rather than piling up
+  if(priority == PRIORITY_READAHEAD && count >= READAHEAD_PENDING_MAX)
+    job_finish(fr,oldest,false);
+  job->next = fr->queue;
+  fr->queue = job;
+  pthread_cond_signal(&fr->scheduler_cond);
+  pthread_mutex_unlock(&fr->lock);
+  return wait ? job : 0;
+}
+
+// Waits until the job is done and frees it. Returns false if anything couldn't be recovered.
+bool scheduler_wait(struct fuserescue* fr, struct recover_job* job){
+  fr_lock(fr);
+  while(!job->done)
+    pthread_cond_wait(&fr->completed_cond,&fr->lock);
+  pthread_mutex_unlock(&fr->lock);
+  bool ok = job->ok;
+  free(job);
+  return ok;
+}
+
+/*
+ * Waits until the job is done and frees it, but not past deadline, which is based on
+ * CLOCK_MONOTONIC. If the deadline passes first, the job continues in the background
+ * and the scheduler frees it. Returns whether the job is done.
+ */
+bool scheduler_wait_until(struct fuserescue* fr, struct recover_job* job, const struct timespec* deadline){
+  fr_lock(fr);
+  while(!job->done){
+    if(pthread_cond_timedwait(&fr->completed_cond,&fr->lock,deadline) == ETIMEDOUT && !job->done){
+      job->detached = true;
+      pthread_mutex_unlock(&fr->lock);
+      return false;
+    }
+  }
+  pthread_mutex_unlock(&fr->lock);
+  free(job);
+  return true;
+}
+
+bool scheduler_recover(struct fuserescue* fr, struct range r, enum recover_priority priority){
+  return scheduler_wait(fr,scheduler_submit(fr,r,priority,true));
+}
+
+// Picks the next job like an elevator going up. fr->lock must be held.
+static struct recover_job* scheduler_pick(struct fuserescue* fr){
+  struct recover_job* ahead = 0;
+  struct recover_job* first = 0;
+  for(struct recover_job* it=fr->queue; it; it=it->next){
+    if(it->running)
+      continue;
+    if(first && it->priority > first->priority)
+      continue;
+    if(first && it->priority < first->priority)
+      ahead = first = 0;
+    if(!first || it->range.start < first->range.start)
+      first = it;
+    if(it->range.start >= fr->head && (!ahead || it->range.start < ahead->range.start))
+      ahead = it;
+  }
+  return ahead ? ahead : first;
+}
+
+void* scheduler_thread(void* param){
+  struct fuserescue* fr = param;
+  char* readbuffer = 0;
+  size_t capacity = 0;
+  fr_lock(fr);
+  while(!fr->exiting){
+    struct recover_job* job = scheduler_pick(fr);
+    if(!job){
+      pthread_cond_wait(&fr->scheduler_cond,&fr->lock);
+      continue;
+    }
+    uint64_t blocksize = fr->blocksize;
+    bool ok = fr->allowed;
+    struct range r = job->range;
+    job->running = true;
+    if(job->priority == PRIORITY_DEMAND){
+      // Take along all demand reads which overlap or touch this one
+      for(bool merged=true; merged;){
+        merged = false;
+        for(struct recover_job* it=fr->queue; it; it=it->next){
+          if(it->running || it->priority != PRIORITY_DEMAND)
+            continue;
+          if(it->range.start <= r.end && it->range.end >= r.start){
+            if(it->range.start < r.start)
+              r.start = it->range.start;
+            if(it->range.end > r.end)
+              r.end = it->range.end;
+            it->running = true;
+            merged = true;
+          }
+        }
+      }
+    }else if(r.end - r.start > blocksize - r.start % blocksize){
+      r.end = r.start + blocksize - r.start % blocksize;
+    }
+    pthread_mutex_unlock(&fr->lock);
+    size_t size = recover_buffer_size(fr,blocksize);
+    if(ok && capacity < size){
+      free(readbuffer);
+      readbuffer = 0;
+      capacity = 0;
+      if(posix_memalign((void**)&readbuffer,BUFFER_ALIGNMENT,size)){
+        perror("failed to allocate read buffer");
+        ok = false;
+      }else{
+        capacity = size;
+      }
+    }
+    if(ok){
+      if(job->priority == PRIORITY_DEMAND){
+        ok = recover_range(fr,readbuffer,r,blocksize);
+      }else{
+        ok = recover_slice(fr,readbuffer,r,priority_name[job->priority]);
+      }
+    }
+    pthread_cond_signal(&fr->checkpoint_cond);
+    fr_lock(fr);
+    fr->head = r.end;
+    if(job->priority == PRIORITY_DEMAND){
+      for(struct recover_job *it=fr->queue, *next; it; it=next){
+        next = it->next;
+        if(it->running)
+          job_finish(fr,it,ok);
+      }
+    }else{
+      job->running = false;
+      job->range.start = r.end;
+      if(!ok || job->range.start >= job->range.end)
+        job_finish(fr,job,ok);
+    }
+  }
+  // Nothing gets recovered anymore, let everyone waiting know
+  while(fr->queue)
+    job_finish(fr,fr->queue,false);
+  pthread_mutex_unlock(&fr->lock);
+  free(readbuffer);
+  return 0;
+}
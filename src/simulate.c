@@ -0,0 +1,212 @@
+/*
+fuserescue, an on demand data recovery tool which recovers data on a first access basis.
+Copyright (C) 2018 Daniel Abrecht
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <fuserescue/fuserescue.h>
+#include <fuserescue/device.h>
+#include <fuserescue/map.h>
+#include <fuserescue/utils.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Simulates a failing device using an image and a mapfile describing it. Finished areas
+ * can be read, nontrimmed and nonscraped areas are weak and can be read after they failed
+ * a number of times, everything else is bad and always fails. Reads take time according to
+ * how many sectors are read, how far the head has to move, and whether a sector failed.
+ */
+struct simulation {
+  struct mapfile* map;
+  unsigned sector_size;
+  uint64_t head;
+  // Costs in microseconds
+  uint64_t sector_cost;
+  uint64_t seek_cost; // per GiB the head moves
+  uint64_t bad_cost; // for the sector a read fails at
+  uint64_t retries; // how often a weak sector fails before it can be read
+  // How often weak sectors failed so far, indexed by sector + 1, 0 is an empty slot
+  size_t tried_count, tried_capacity;
+  struct weak_sector {
+    uint64_t key;
+    uint64_t tries;
+  }* tried;
+};
+
+static struct weak_sector* weak_sector(struct simulation* sim, uint64_t sector){
+  if(sim->tried_count * 2 >= sim->tried_capacity){
+    size_t capacity = sim->tried_capacity ? sim->tried_capacity * 2 : 1024;
+    struct weak_sector* tried = calloc(capacity,sizeof(*tried));
+    if(!tried){
+      perror("failed to allocate weak sectors");
+      exit(4);
+    }
+    for(size_t i=0; i<sim->tried_capacity; i++){
+      if(!sim->tried[i].key)
+        continue;
+      size_t j = sim->tried[i].key * UINT64_C(0x9E3779B97F4A7C15) >> 32 & (capacity-1);
+      while(tried[j].key)
+        j = (j + 1) & (capacity-1);
+      tried[j] = sim->tried[i];
+    }
+    free(sim->tried);
+    sim->tried = tried;
+    sim->tried_capacity = capacity;
+  }
+  uint64_t key = sector + 1;
+  size_t i = key * UINT64_C(0x9E3779B97F4A7C15) >> 32 & (sim->tried_capacity-1);
+  while(sim->tried[i].key && sim->tried[i].key != key)
+    i = (i + 1) & (sim->tried_capacity-1);
+  if(!sim->tried[i].key){
+    sim->tried[i].key = key;
+    sim->tried_count++;
+  }
+  return &sim->tried[i];
+}
+
+// Returns where a read of [start, end) fails, or end if it doesn't
+static uint64_t simulate_failure(struct simulation* sim, uint64_t start, uint64_t end){
+  uint64_t pos = start;
+  struct map_iterator it;
+  struct mapentry entry;
+  map_iterate(sim->map,&it,start);
+  while(pos < end && map_next(&it,&entry)){
+    if(entry.offset >= end)
+      break;
+    if(entry.offset + entry.size <= pos)
+      continue;
+    if(entry.offset > pos)
+      return pos;
+    uint64_t stop = entry.offset + entry.size < end ? entry.offset + entry.size : end;
+    switch(entry.state){
+      case ME_FINISHED: break;
+      case ME_NON_TRIMMED:
+      case ME_NON_SCRAPED: {
+        if(!sim->retries)
+          break;
+        for(uint64_t s=pos/sim->sector_size; s*sim->sector_size<stop; s++){
+          struct weak_sector* weak = weak_sector(sim,s);
+          if(weak->tries < sim->retries){
+            weak->tries++;
+            return s*sim->sector_size > pos ? s*sim->sector_size : pos;
+          }
+        }
+      } break;
+      default: return pos;
+    }
+    pos = stop;
+  }
+  return pos < end ? pos : end;
+}
+
+static void wait_us(uint64_t us){
+  struct timespec ts = {us / 1000000, us % 1000000 * 1000};
+  while(nanosleep(&ts,&ts) && errno == EINTR);
+}
+
+static void simulate_read(struct device* dev, struct device_read* reads, size_t count){
+  struct simulation* sim = dev->data;
+  for(size_t i=0; i<count; i++){
+    struct device_read* rd = &reads[i];
+    uint64_t end = rd->offset + rd->size;
+    uint64_t distance = rd->offset > sim->head ? rd->offset - sim->head : sim->head - rd->offset;
+    uint64_t fail = simulate_failure(sim,rd->offset,end);
+    uint64_t cost = (distance >> 20) * sim->seek_cost / 1024
+                  + (fail - rd->offset + sim->sector_size - 1) / sim->sector_size * sim->sector_cost;
+    if(fail < end)
+      cost += sim->bad_cost;
+    if(dev->timeout && cost > dev->timeout * 1000){
+      wait_us(dev->timeout * 1000);
+      rd->result = -1;
+      rd->error = ETIMEDOUT;
+      sim->head = fail;
+      continue;
+    }
+    wait_us(cost);
+    sim->head = fail;
+    if(fail < end){
+      rd->result = -1;
+      rd->error = EIO;
+      continue;
+    }
+    do {
+      rd->result = pread(dev->fd,rd->buf,rd->size,rd->offset);
+    } while(rd->result < 0 && errno == EINTR);
+    rd->error = rd->result < 0 ? errno : 0;
+  }
+}
+
+static void simulate_close(struct device* dev){
+  struct simulation* sim = dev->data;
+  map_free(sim->map);
+  free(sim->tried);
+  free(sim);
+}
+
+static const struct device_ops simulate_ops = {
+  .name = "simulate",
+  .read = simulate_read,
+  .close = simulate_close
+};
+
+/*
+ * spec is mapfile[,sector=us][,seek=us][,bad=us][,retries=N], see struct simulation.
+ * Reads taking longer than timeout milliseconds fail with ETIMEDOUT after that time.
+ */
+bool device_open_simulation(struct device* dev, int fd, const char* spec, unsigned sector_size, uint64_t timeout){
+  struct simulation* sim = calloc(1,sizeof(*sim));
+  if(!sim)
+    return false;
+  sim->sector_size = sector_size;
+  const char* options = strchr(spec,',');
+  size_t length = options ? (size_t)(options - spec) : strlen(spec);
+  char mapfile[length+1];
+  memcpy(mapfile,spec,length);
+  mapfile[length] = 0;
+  while(options && *options){
+    const char* s = options + 1;
+    if( !parse_option(&s,"sector",&sim->sector_cost)
+     && !parse_option(&s,"seek",&sim->seek_cost)
+     && !parse_option(&s,"bad",&sim->bad_cost)
+     && !parse_option(&s,"retries",&sim->retries)
+    ) goto error;
+    if(*s && *s != ',')
+      goto error;
+    options = *s ? s : 0;
+  }
+  sim->map = map_read(mapfile);
+  if(!sim->map)
+    goto error_errno;
+  *dev = (struct device){
+    .ops = &simulate_ops,
+    .fd = fd,
+    .depth = 1,
+    .timeout = timeout,
+    .data = sim
+  };
+  return true;
+error:
+  errno = EINVAL;
+error_errno:;
+  int err = errno;
+  free(sim);
+  errno = err;
+  return false;
+}
@@ -0,0 +1,279 @@
+/*
+fuserescue, an on demand data recovery tool which recovers data on a first access basis.
+Copyright (C) 2018 Daniel Abrecht
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <fuserescue/fuserescue.h>
+#include <fuserescue/source.h>
+#include <fuserescue/map.h>
+#include <fuserescue/utils.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+// spec is path[,offset=N][,map=mapfile][,no-direct-io], the mapfile is read right away
+bool source_parse(struct source* source, const char* spec){
+  *source = (struct source){
+    .fd = -1,
+    .directio = true
+  };
+  const char* options = strchr(spec,',');
+  size_t length = options ? (size_t)(options - spec) : strlen(spec);
+  source->path = strndup(spec,length);
+  if(!source->path)
+    return false;
+  while(options && *options){
+    const char* s = options + 1;
+    if(!strncmp(s,"map=",4)){
+      s += 4;
+      const char* end = strchr(s,',');
+      length = end ? (size_t)(end - s) : strlen(s);
+      char mapfile[length+1];
+      memcpy(mapfile,s,length);
+      mapfile[length] = 0;
+      if(source->map)
+        map_free(source->map);
+      source->map = map_read(mapfile);
+      if(!source->map)
+        goto error_errno;
+      s += length;
+    }else if(!strncmp(s,"no-direct-io",12)){
+      source->directio = false;
+      s += 12;
+    }else if(!parse_option(&s,"offset",&source->offset)){
+      goto error;
+    }
+    if(*s && *s != ',')
+      goto error;
+    options = *s ? s : 0;
+  }
+  return true;
+error:
+  errno = EINVAL;
+error_errno:;
+  int err = errno;
+  if(source->map)
+    map_free(source->map);
+  free(source->path);
+  source->path = 0;
+  source->map = 0;
+  errno = err;
+  return false;
+}
+
+static int source_open_path(const struct source* source, const char* path){
+  int flags = O_RDONLY | O_BINARY;
+  if(source->directio)
+    flags |= O_DIRECT;
+  return open(path,flags);
+}
+
+bool source_open(struct source* source){
+  source->fd = source_open_path(source,source->path);
+  return source->fd != -1;
+}
+
+/*
+ * Opens path, or the current path if it's 0, in place of the file the source read from so far.
+ * The path is only changed under fr->lock, the sources command shows it.
+ */
+bool source_reopen(struct fuserescue* fr, struct source* source, const char* path){
+  fr_lock(fr);
+  char* copy = strdup(path ? path : source->path);
+  pthread_mutex_unlock(&fr->lock);
+  if(!copy)
+    return false;
+  int fd = source_open_path(source,copy);
+  if(fd == -1){
+    free(copy);
+    return false;
+  }
+  if(dup2(fd,source->fd) < 0){
+    int err = errno;
+    close(fd);
+    free(copy);
+    errno = err;
+    return false;
+  }
+  close(fd);
+  fr_lock(fr);
+  char* old = source->path;
+  source->path = copy;
+  pthread_mutex_unlock(&fr->lock);
+  free(old);
+  return true;
+}
+
+// Where the map of what was recovered from a source is saved if there are several
+char* source_mapfile(const char* mapfile, size_t index){
+  char* path = malloc(strlen(mapfile)+sizeof(".source")+20);
+  if(!path){
+    perror("failed to allocate source mapfile path");
+    exit(4);
+  }
+  sprintf(path,"%s.source%zu",mapfile,index);
+  return path;
+}
+
+void source_close(struct source* source){
+  device_close(&source->device);
+  if(source->map)
+    map_free(source->map);
+  if(source->recovered)
+    map_free(source->recovered);
+  source->map = 0;
+  source->recovered = 0;
+}
+
+// Whether a is healthier than b: it failed less often, or as often but was faster. Unused sources count as fastest.
+static bool source_better(const struct source* a, const struct source* b){
+  uint64_t fa = a->failures * (b->reads ? b->reads : 1);
+  uint64_t fb = b->failures * (a->reads ? a->reads : 1);
+  if(fa != fb)
+    return fa < fb;
+  if(!a->busy_ns || !b->busy_ns)
+    return !a->busy_ns && b->busy_ns;
+  return (double)a->bytes / a->busy_ns > (double)b->bytes / b->busy_ns;
+}
+
+// How much of the read the source can provide, everything unless its map says otherwise
+static size_t source_available(struct fuserescue* fr, const struct source* source, const struct device_read* rd){
+  if(!source->map)
+    return rd->size;
+  // The read starts at a sector boundary, which may be a bit before the start of the image
+  uint64_t pos = 0;
+  size_t lead = 0;
+  if(rd->offset < fr->source[0].offset){
+    lead = fr->source[0].offset - rd->offset;
+  }else{
+    pos = rd->offset - fr->source[0].offset;
+  }
+  struct map_iterator it;
+  struct mapentry entry;
+  map_iterate(source->map,&it,pos);
+  if(!map_next(&it,&entry) || entry.state != ME_FINISHED || entry.offset > pos)
+    return 0;
+  uint64_t size = entry.offset + entry.size - pos + lead;
+  if(size > rd->size)
+    size = rd->size;
+  if(source->directio)
+    size = size / fr->sector_size * fr->sector_size;
+  return size;
+}
+
+/*
+ * Does the reads, which are set up for the first source, see block_read. Each read is done
+ * on the healthiest source first. Reads which don't return everything are tried on the next
+ * one, and so on, the one which returned the most is kept. If all sources failed, the error
+ * is ETIMEDOUT if any of them timed out, so the read is tried again later. Only the thread
+ * reading the device calls this, and count must not exceed QUEUE_DEPTH_MAX.
+ */
+void source_read(struct fuserescue* fr, struct device_read* reads, size_t count){
+  unsigned order[SOURCES_MAX];
+  for(unsigned i=0; i<fr->source_count; i++){
+    unsigned j = i;
+    for(; j && source_better(&fr->source[i],&fr->source[order[j-1]]); j--)
+      order[j] = order[j-1];
+    order[j] = i;
+  }
+  for(size_t i=0; i<count; i++){
+    reads[i].result = -1;
+    reads[i].error = 0;
+    reads[i].source = order[0];
+  }
+  char* bounce = 0; // for reads which already returned something, slot[i] is where read i goes
+  size_t slot[QUEUE_DEPTH_MAX];
+  size_t bounce_size = 0;
+  for(size_t i=0; i<count; i++){
+    slot[i] = bounce_size;
+    bounce_size += (reads[i].size + BUFFER_ALIGNMENT - 1) / BUFFER_ALIGNMENT * BUFFER_ALIGNMENT;
+  }
+  for(unsigned o=0; o<fr->source_count; o++){
+    struct source* source = &fr->source[order[o]];
+    struct device_read batch[QUEUE_DEPTH_MAX];
+    size_t index[QUEUE_DEPTH_MAX];
+    size_t skip[QUEUE_DEPTH_MAX]; // bytes before the image this source can't read, they count as read
+    size_t n = 0;
+    for(size_t i=0; i<count; i++){
+      if(reads[i].result == (ssize_t)reads[i].size)
+        continue;
+      size_t size = source_available(fr,source,&reads[i]);
+      if(size <= (size_t)(reads[i].result > 0 ? reads[i].result : 0))
+        continue;
+      // The read may start before the image, by more than this source has in front of it
+      size_t lead = reads[i].offset < fr->source[0].offset ? fr->source[0].offset - reads[i].offset : 0;
+      skip[n] = lead > source->offset ? lead - source->offset : 0;
+      if(size <= skip[n])
+        continue;
+      batch[n] = (struct device_read){
+        .offset = reads[i].offset + skip[n] + source->offset - fr->source[0].offset,
+        .size = size - skip[n],
+        .buf = reads[i].buf + skip[n]
+      };
+      // Don't overwrite what an earlier source returned
+      if(reads[i].result > 0){
+        if(!bounce && posix_memalign((void**)&bounce,BUFFER_ALIGNMENT,bounce_size)){
+          perror("failed to allocate read buffer");
+          exit(4);
+        }
+        batch[n].buf = bounce + slot[i] + skip[n];
+      }
+      index[n++] = i;
+    }
+    if(!n)
+      continue;
+    uint64_t start = stats_now();
+    device_read(&source->device,batch,n);
+    stats_add(&source->busy_ns,stats_now()-start);
+    for(size_t k=0; k<n; k++){
+      struct device_read* rd = &batch[k];
+      struct device_read* read = &reads[index[k]];
+      stats_device_read(&fr->stats,rd->size,start);
+      if(rd->offset != source->head)
+        stats_add(&fr->stats.seeks,1);
+      source->head = rd->offset + rd->size;
+      stats_add(&source->reads,1);
+      if(rd->result != (ssize_t)rd->size)
+        stats_add(&source->failures,1);
+      if(rd->result > 0)
+        stats_add(&source->bytes,rd->result);
+      ssize_t result = rd->result > 0 ? rd->result + (ssize_t)skip[k] : rd->result;
+      if(result > read->result){
+        if(rd->buf != read->buf + skip[k])
+          memcpy(read->buf+skip[k],rd->buf,rd->result);
+        read->result = result;
+        read->error = 0;
+        read->source = order[o];
+      }else if(read->result < 0 && (!read->error || rd->error == ETIMEDOUT)){
+        read->error = rd->error;
+        read->source = order[o];
+      }
+    }
+  }
+  free(bounce);
+  for(size_t i=0; i<count; i++)
+    if(reads[i].result < 0 && !reads[i].error)
+      reads[i].error = EIO;
+}
@@ -0,0 +1,295 @@
+/*
+fuserescue, an on demand data recovery tool which recovers data on a first access basis.
+Copyright (C) 2018 Daniel Abrecht
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <fuserescue/fuserescue.h>
+#include <fuserescue/stats.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static const char* const state_name[] = {
+  [ME_NON_TRIED] = "nontried",
+  [ME_NON_TRIMMED] = "nontrimmed",
+  [ME_NON_SCRAPED] = "nonscraped",
+  [ME_BAD_SECTOR] = "badsector",
+  [ME_FINISHED] = "finished",
+  [ME_NONE] = "unmapped"
+};
+
+static const char* const format_name[] = {
+  [STATS_TEXT] = "text",
+  [STATS_JSON] = "json",
+  [STATS_PROMETHEUS] = "prometheus"
+};
+
+static inline uint64_t load(const uint64_t* x){
+  return __atomic_load_n(x,__ATOMIC_RELAXED);
+}
+
+uint64_t stats_now(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void stats_add(uint64_t* counter, uint64_t n){
+  __atomic_fetch_add(counter,n,__ATOMIC_RELAXED);
+}
+
+void stats_record(struct histogram* h, uint64_t ns){
+  uint64_t us = ns / 1000;
+  unsigned i = 0;
+  while(i < STATS_BUCKETS-1 && us >> i)
+    i++;
+  stats_add(&h->count,1);
+  stats_add(&h->sum,ns);
+  stats_add(&h->bucket[i],1);
+}
+
+// Records the time since start, which was taken using stats_now
+void stats_time(struct histogram* h, uint64_t start){
+  stats_record(h,stats_now()-start);
+}
+
+void stats_device_read(struct stats* stats, uint64_t size, uint64_t start){
+  unsigned i = 0;
+  while(i < STATS_SIZES-1 && size > (UINT64_C(1) << (STATS_SIZE_MIN_LOG2 + i)))
+    i++;
+  stats_time(&stats->device_read[i],start);
+}
+
+void stats_reset(struct stats* stats){
+  uint64_t* counters[] = {&stats->reads, &stats->bytes_served, &stats->bytes_recovered, &stats->readahead_rejected, &stats->seeks};
+  for(size_t i=0; i<sizeof(counters)/sizeof(*counters); i++)
+    __atomic_store_n(counters[i],0,__ATOMIC_RELAXED);
+  for(size_t i=0; i<=ME_NONE; i++)
+    __atomic_store_n(&stats->eio[i],0,__ATOMIC_RELAXED);
+  struct histogram* histograms[STATS_SIZES+3] = {&stats->map_lookup, &stats->save, &stats->lock_wait};
+  for(size_t i=0; i<STATS_SIZES; i++)
+    histograms[3+i] = &stats->device_read[i];
+  for(size_t i=0; i<STATS_SIZES+3; i++){
+    struct histogram* h = histograms[i];
+    __atomic_store_n(&h->count,0,__ATOMIC_RELAXED);
+    __atomic_store_n(&h->sum,0,__ATOMIC_RELAXED);
+    for(size_t j=0; j<STATS_BUCKETS; j++)
+      __atomic_store_n(&h->bucket[j],0,__ATOMIC_RELAXED);
+  }
+}
+
+bool stats_parse_format(const char* name, enum stats_format* format){
+  for(size_t i=0; i<sizeof(format_name)/sizeof(*format_name); i++){
+    if(!strcmp(name,format_name[i])){
+      *format = i;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Upper bound of the duration below which a fraction q of the recorded ones are, in microseconds
+static uint64_t quantile(const struct histogram* h, uint64_t count, double q){
+  uint64_t n = 0;
+  for(unsigned i=0; i<STATS_BUCKETS; i++){
+    n += load(&h->bucket[i]);
+    if(n && n >= q * count)
+      return UINT64_C(1) << i;
+  }
+  return UINT64_C(1) << (STATS_BUCKETS-1);
+}
+
+static void print_histogram(FILE* f, enum stats_format format, const char* name, const char* label, const struct histogram* h){
+  uint64_t count = load(&h->count);
+  uint64_t sum = load(&h->sum);
+  switch(format){
+    case STATS_TEXT: {
+      fprintf(f,"%s%s%s: %"PRIu64" times",name,label?" ":"",label?label:"",count);
+      if(count)
+        fprintf(f,", avg %"PRIu64" us, p50 < %"PRIu64" us, p99 < %"PRIu64" us",
+          sum / count / 1000, quantile(h,count,0.5), quantile(h,count,0.99));
+      fputc('\n',f);
+    } break;
+    case STATS_JSON: {
+      fprintf(f,"{\"count\":%"PRIu64",\"sum_ns\":%"PRIu64",\"buckets_us\":[",count,sum);
+      for(unsigned i=0; i<STATS_BUCKETS; i++)
+        fprintf(f,"%s%"PRIu64,i?",":"",load(&h->bucket[i]));
+      fprintf(f,"]}");
+    } break;
+    case STATS_PROMETHEUS: {
+      char sep = label ? ',' : '{';
+      uint64_t n = 0;
+      for(unsigned i=0; i<STATS_BUCKETS; i++){
+        n += load(&h->bucket[i]);
+        fprintf(f,"fuserescue_%s_seconds_bucket%s%s%cle=\"",name,label?"{":"",label?label:"",sep);
+        if(i < STATS_BUCKETS-1){
+          fprintf(f,"%g\"} %"PRIu64"\n",(double)(UINT64_C(1) << i) / 1e6,n);
+        }else{
+          fprintf(f,"+Inf\"} %"PRIu64"\n",n);
+        }
+      }
+      fprintf(f,"fuserescue_%s_seconds_sum%s%s%s %g\n",name,label?"{":"",label?label:"",label?"}":"",sum/1e9);
+      fprintf(f,"fuserescue_%s_seconds_count%s%s%s %"PRIu64"\n",name,label?"{":"",label?label:"",label?"}":"",count);
+    } break;
+  }
+}
+
+void stats_print(struct stats* stats, FILE* f, enum stats_format format){
+  const struct {
+    const char* name;
+    const uint64_t* value;
+  } counter[] = {
+    {"reads", &stats->reads},
+    {"bytes_served", &stats->bytes_served},
+    {"bytes_recovered", &stats->bytes_recovered},
+    {"readahead_rejected", &stats->readahead_rejected},
+    {"seeks", &stats->seeks}
+  };
+  const struct {
+    const char* name;
+    const struct histogram* h;
+  } histogram[] = {
+    {"map_lookup", &stats->map_lookup},
+    {"save", &stats->save},
+    {"lock_wait", &stats->lock_wait}
+  };
+  const size_t counters = sizeof(counter)/sizeof(*counter);
+  const size_t histograms = sizeof(histogram)/sizeof(*histogram);
+  char label[32];
+
+  switch(format){
+    case STATS_TEXT: {
+      for(size_t i=0; i<counters; i++)
+        fprintf(f,"%s = %"PRIu64"\n",counter[i].name,load(counter[i].value));
+      for(size_t i=0; i<=ME_NONE; i++)
+        if(load(&stats->eio[i]))
+          fprintf(f,"eio %s = %"PRIu64"\n",state_name[i],load(&stats->eio[i]));
+      for(size_t i=0; i<STATS_SIZES; i++){
+        if(!load(&stats->device_read[i].count))
+          continue;
+        sprintf(label,"%"PRIu64,UINT64_C(1) << (STATS_SIZE_MIN_LOG2 + i));
+        print_histogram(f,format,"device_read",label,&stats->device_read[i]);
+      }
+      for(size_t i=0; i<histograms; i++)
+        print_histogram(f,format,histogram[i].name,0,histogram[i].h);
+    } break;
+    case STATS_JSON: {
+      fputc('{',f);
+      for(size_t i=0; i<counters; i++)
+        fprintf(f,"\"%s\":%"PRIu64",",counter[i].name,load(counter[i].value));
+      fprintf(f,"\"eio\":{");
+      for(size_t i=0; i<=ME_NONE; i++)
+        fprintf(f,"%s\"%s\":%"PRIu64,i?",":"",state_name[i],load(&stats->eio[i]));
+      fprintf(f,"},\"device_read\":{");
+      bool first = true;
+      for(size_t i=0; i<STATS_SIZES; i++){
+        if(!load(&stats->device_read[i].count))
+          continue;
+        fprintf(f,"%s\"%"PRIu64"\":",first?"":",",UINT64_C(1) << (STATS_SIZE_MIN_LOG2 + i));
+        print_histogram(f,format,0,0,&stats->device_read[i]);
+        first = false;
+      }
+      fputc('}',f);
+      for(size_t i=0; i<histograms; i++){
+        fprintf(f,",\"%s\":",histogram[i].name);
+        print_histogram(f,format,0,0,histogram[i].h);
+      }
+      fprintf(f,"}\n");
+    } break;
+    case STATS_PROMETHEUS: {
+      for(size_t i=0; i<counters; i++){
+        fprintf(f,"# TYPE fuserescue_%s_total counter\n",counter[i].name);
+        fprintf(f,"fuserescue_%s_total %"PRIu64"\n",counter[i].name,load(counter[i].value));
+      }
+      fprintf(f,"# TYPE fuserescue_eio_total counter\n");
+      for(size_t i=0; i<=ME_NONE; i++)
+        fprintf(f,"fuserescue_eio_total{state=\"%s\"} %"PRIu64"\n",state_name[i],load(&stats->eio[i]));
+      fprintf(f,"# TYPE fuserescue_device_read_seconds histogram\n");
+      for(size_t i=0; i<STATS_SIZES; i++){
+        if(!load(&stats->device_read[i].count))
+          continue;
+        sprintf(label,"size=\"%"PRIu64"\"",UINT64_C(1) << (STATS_SIZE_MIN_LOG2 + i));
+        print_histogram(f,format,"device_read",label,&stats->device_read[i]);
+      }
+      for(size_t i=0; i<histograms; i++){
+        fprintf(f,"# TYPE fuserescue_%s_seconds histogram\n",histogram[i].name);
+        print_histogram(f,format,histogram[i].name,0,histogram[i].h);
+      }
+    } break;
+  }
+}
+
+// Locks fr->lock, keeping track of how long that took
+void fr_lock(struct fuserescue* fr){
+  if(!pthread_mutex_trylock(&fr->lock)){
+    stats_record(&fr->stats.lock_wait,0);
+    return;
+  }
+  uint64_t start = stats_now();
+  pthread_mutex_lock(&fr->lock);
+  stats_time(&fr->stats.lock_wait,start);
+}
+
+// Writes the statistics to a temporary file and replaces the stats file with it
+static void write_stats(struct stats* stats, const char* file, enum stats_format format){
+  char tmpfile[strlen(file)+sizeof(".tmp")];
+  sprintf(tmpfile,"%s.tmp",file);
+  FILE* f = fopen(tmpfile,"w");
+  if(!f){
+    perror("failed to open stats file");
+    return;
+  }
+  stats_print(stats,f,format);
+  if(fclose(f)){
+    perror("failed to write stats file");
+    return;
+  }
+  if(rename(tmpfile,file))
+    perror("failed to replace stats file");
+}
+
+// Dumps the statistics to stats.file every stats.interval seconds, and once more when exiting
+void* stats_thread(void* param){
+  struct fuserescue* fr = param;
+  struct stats* stats = &fr->stats;
+  pthread_mutex_lock(&fr->lock);
+  while(true){
+    bool exiting = fr->exiting;
+    if(!exiting && (!stats->file || !stats->interval)){
+      pthread_cond_wait(&stats->cond,&fr->lock);
+      continue;
+    }
+    if(!exiting){
+      struct timespec ts;
+      clock_gettime(CLOCK_MONOTONIC,&ts);
+      ts.tv_sec += stats->interval;
+      if(pthread_cond_timedwait(&stats->cond,&fr->lock,&ts) != ETIMEDOUT)
+        continue; // the settings changed or we're exiting, which also gets a dump
+    }
+    char* file = stats->file ? strdup(stats->file) : 0;
+    enum stats_format format = stats->format;
+    pthread_mutex_unlock(&fr->lock);
+    if(file)
+      write_stats(stats,file,format);
+    free(file);
+    if(exiting)
+      return 0;
+    pthread_mutex_lock(&fr->lock);
+  }
+}
@@ -0,0 +1,104 @@
+/*
+fuserescue, an on demand data recovery tool which recovers data on a first access basis.
+Copyright (C) 2018 Daniel Abrecht
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <fuserescue/fuserescue.h>
+#include <fuserescue/trace.h>
+#include <fuserescue/stats.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+bool trace_open(struct trace* trace, const char* path){
+  pthread_mutex_init(&trace->lock,0);
+  trace->file = fopen(path,"wb");
+  if(!trace->file)
+    return false;
+  setvbuf(trace->file,0,_IOFBF,0x10000);
+  struct trace_header header = {
+    .magic = TRACE_MAGIC,
+    .version = TRACE_VERSION
+  };
+  trace->start = stats_now();
+  if(fwrite(&header,sizeof(header),1,trace->file) != 1){
+    fclose(trace->file);
+    trace->file = 0;
+    return false;
+  }
+  return true;
+}
+
+static void write_ranges(FILE* file, const struct range_list* list, enum trace_kind kind){
+  if(!list)
+    return;
+  for(size_t i=0; i<list->count; i++){
+    struct trace_range range = {
+      .start = list->range[i].start | (uint64_t)kind << TRACE_KIND_SHIFT,
+      .end = list->range[i].end
+    };
+    fwrite(&range,sizeof(range),1,file);
+  }
+}
+
+/*
+ * Appends a record for a fuse read which started at start, as returned by stats_now.
+ * Any of the range lists may be null.
+ */
+void trace_read(
+  struct trace* trace,
+  uint64_t start, uint64_t offset, uint32_t size, int32_t result,
+  const struct range_list* finished,
+  const struct range_list* to_recover,
+  const struct range_list* failed
+){
+  if(!trace->file)
+    return;
+  uint64_t now = stats_now();
+  struct trace_record record = {
+    .time = start - trace->start,
+    .latency = now - start,
+    .offset = offset,
+    .size = size,
+    .result = result,
+    .count = (finished ? finished->count : 0)
+           + (to_recover ? to_recover->count : 0)
+           + (failed ? failed->count : 0)
+  };
+  pthread_mutex_lock(&trace->lock);
+  // The file is closed if writing failed in the meantime
+  if(trace->file && fwrite(&record,sizeof(record),1,trace->file) != 1){
+    perror("failed to write trace, stopping it");
+    fclose(trace->file);
+    trace->file = 0;
+  }
+  if(trace->file){
+    write_ranges(trace->file,finished,TRACE_FINISHED);
+    write_ranges(trace->file,to_recover,TRACE_TO_RECOVER);
+    write_ranges(trace->file,failed,TRACE_FAILED);
+  }
+  pthread_mutex_unlock(&trace->lock);
+}
+
+void trace_close(struct trace* trace){
+  if(!trace->file)
+    return;
+  pthread_mutex_lock(&trace->lock);
+  if(fclose(trace->file))
+    perror("failed to write trace");
+  trace->file = 0;
+  pthread_mutex_unlock(&trace->lock);
+  pthread_mutex_destroy(&trace->lock);
+}
@@ -0,0 +1,342 @@
+/*
+fuserescue, an on demand data recovery tool which recovers data on a first access basis.
+Copyright (C) 2018 Daniel Abrecht
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <fuserescue/fuserescue.h>
+#include <fuserescue/device.h>
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Reads using io_uring, each with a linked timeout. If a read takes too long, the timeout
+ * cancels it and the read fails with ETIMEDOUT. Reads which are already with the device
+ * often can't be cancelled, those are abandoned instead. They keep their buffer until
+ * they complete, so the caller doesn't have to wait for them.
+ */
+
+#define TAG_TIMEOUT 1
+#define TAG_SLOT_SHIFT 1
+#define TAG_GENERATION_SHIFT 32
+
+enum slot_state {
+  SLOT_FREE,
+  SLOT_BUSY, // a read is in flight and someone waits for it
+  SLOT_ABANDONED // a read is in flight, but nobody waits for it anymore
+};
+
+struct slot {
+  enum slot_state state;
+  uint32_t generation; // tells completions of earlier reads using this slot apart
+  char* buf;
+  size_t capacity;
+  struct device_read* read;
+  struct __kernel_timespec timeout;
+};
+
+struct uring {
+  int fd;
+  void* sq_ring;
+  void* cq_ring;
+  size_t sq_ring_size, cq_ring_size;
+  struct io_uring_sqe* sqes;
+  size_t sqes_size;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe* cqes;
+  size_t slot_count;
+  struct slot slot[];
+};
+
+static int io_uring_setup(unsigned entries, struct io_uring_params* params){
+  return syscall(__NR_io_uring_setup,entries,params);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags){
+  return syscall(__NR_io_uring_enter,fd,to_submit,min_complete,flags,0,0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void* arg, unsigned nr_args){
+  return syscall(__NR_io_uring_register,fd,opcode,arg,nr_args);
+}
+
+/*
+ * Reads and linked timeouts need linux 5.6. The probe came with the same version, so
+ * if it fails, the kernel is too old.
+ */
+static bool uring_supported(int fd){
+  static const unsigned char needed[] = { IORING_OP_READ, IORING_OP_LINK_TIMEOUT };
+  const unsigned count = 256;
+  struct io_uring_probe* probe = calloc(1,sizeof(*probe)+count*sizeof(struct io_uring_probe_op));
+  if(!probe)
+    return false;
+  bool supported = io_uring_register(fd,IORING_REGISTER_PROBE,probe,count) >= 0;
+  for(size_t i=0; supported && i<sizeof(needed); i++)
+    supported = needed[i] < probe->ops_len && (probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED);
+  free(probe);
+  if(!supported)
+    errno = EOPNOTSUPP;
+  return supported;
+}
+
+static struct io_uring_sqe* uring_sqe(struct uring* u){
+  unsigned tail = *u->sq_tail;
+  unsigned index = tail & *u->sq_mask;
+  struct io_uring_sqe* sqe = &u->sqes[index];
+  memset(sqe,0,sizeof(*sqe));
+  u->sq_array[index] = index;
+  __atomic_store_n(u->sq_tail,tail+1,__ATOMIC_RELEASE);
+  return sqe;
+}
+
+static void uring_submit(struct uring* u, unsigned count){
+  while(count){
+    int ret = io_uring_enter(u->fd,count,0,0);
+    if(ret < 0){
+      if(errno == EINTR || errno == EAGAIN || errno == EBUSY)
+        continue;
+      perror("io_uring_enter failed");
+      exit(3);
+    }
+    count -= ret;
+  }
+}
+
+static void slot_complete(struct slot* slot, ssize_t result, int error){
+  struct device_read* rd = slot->read;
+  if(result > 0)
+    memcpy(rd->buf,slot->buf,result);
+  rd->result = result;
+  rd->error = error;
+  slot->read = 0;
+}
+
+// Handles all available completions, returns how many reads waited for got done
+static size_t uring_reap(struct uring* u){
+  size_t done = 0;
+  unsigned head = *u->cq_head;
+  unsigned tail = __atomic_load_n(u->cq_tail,__ATOMIC_ACQUIRE);
+  for(; head != tail; head++){
+    struct io_uring_cqe* cqe = &u->cqes[head & *u->cq_mask];
+    uint64_t tag = cqe->user_data;
+    if(((uint32_t)tag >> TAG_SLOT_SHIFT) >= u->slot_count)
+      continue;
+    struct slot* slot = &u->slot[(uint32_t)tag >> TAG_SLOT_SHIFT];
+    if(slot->generation != tag >> TAG_GENERATION_SHIFT || slot->state == SLOT_FREE)
+      continue;
+    if(tag & TAG_TIMEOUT){
+      /*
+       * Unless the read completed in time, which cancels the timeout, the timeout expired.
+       * If the read could be cancelled, it completes with ECANCELED later. If it's already
+       * with the device, the timeout completes with EALREADY or ENOENT, and the read may
+       * never complete. Either way, nobody waits for it anymore.
+       */
+      if(cqe->res != -ECANCELED && slot->state == SLOT_BUSY){
+        slot_complete(slot,-1,ETIMEDOUT);
+        slot->state = SLOT_ABANDONED;
+        done++;
+      }
+      continue;
+    }
+    if(slot->state == SLOT_BUSY){
+      if(cqe->res >= 0){
+        slot_complete(slot,cqe->res,0);
+      }else{
+        slot_complete(slot,-1,cqe->res == -ECANCELED ? ETIMEDOUT : -cqe->res);
+      }
+      done++;
+    }
+    slot->state = SLOT_FREE;
+  }
+  __atomic_store_n(u->cq_head,head,__ATOMIC_RELEASE);
+  return done;
+}
+
+static void uring_wait(struct uring* u){
+  if(io_uring_enter(u->fd,0,1,IORING_ENTER_GETEVENTS) < 0 && errno != EINTR){
+    perror("io_uring_enter failed");
+    exit(3);
+  }
+}
+
+static struct slot* uring_slot(struct uring* u, size_t size){
+  for(;;){
+    for(size_t i=0; i<u->slot_count; i++){
+      struct slot* slot = &u->slot[i];
+      if(slot->state != SLOT_FREE)
+        continue;
+      if(slot->capacity < size){
+        free(slot->buf);
+        slot->buf = 0;
+        slot->capacity = 0;
+        if(posix_memalign((void**)&slot->buf,BUFFER_ALIGNMENT,size)){
+          perror("failed to allocate read buffer");
+          exit(4);
+        }
+        slot->capacity = size;
+      }
+      slot->generation++;
+      return slot;
+    }
+    // Everything is taken by abandoned reads, there is nothing to do but to wait for them
+    uring_wait(u);
+    uring_reap(u);
+  }
+}
+
+static void uring_read(struct device* dev, struct device_read* reads, size_t count){
+  struct uring* u = dev->data;
+  uring_reap(u);
+  for(size_t i=0; i<count;){
+    size_t n = count - i < dev->depth ? count - i : dev->depth;
+    unsigned sqes = 0;
+    for(size_t j=0; j<n; j++){
+      struct device_read* rd = &reads[i+j];
+      struct slot* slot = uring_slot(u,rd->size);
+      uint64_t tag = (uint64_t)slot->generation << TAG_GENERATION_SHIFT | (uint64_t)(slot - u->slot) << TAG_SLOT_SHIFT;
+      slot->state = SLOT_BUSY;
+      slot->read = rd;
+      struct io_uring_sqe* sqe = uring_sqe(u);
+      sqe->opcode = IORING_OP_READ;
+      sqe->fd = dev->fd;
+      sqe->addr = (uintptr_t)slot->buf;
+      sqe->len = rd->size;
+      sqe->off = rd->offset;
+      sqe->user_data = tag;
+      sqes++;
+      if(dev->timeout){
+        sqe->flags |= IOSQE_IO_LINK;
+        slot->timeout.tv_sec = dev->timeout / 1000;
+        slot->timeout.tv_nsec = dev->timeout % 1000 * 1000000;
+        sqe = uring_sqe(u);
+        sqe->opcode = IORING_OP_LINK_TIMEOUT;
+        sqe->addr = (uintptr_t)&slot->timeout;
+        sqe->len = 1;
+        sqe->user_data = tag | TAG_TIMEOUT;
+        sqes++;
+      }
+    }
+    uring_submit(u,sqes);
+    for(size_t done=0; done<n;){
+      done += uring_reap(u);
+      if(done < n)
+        uring_wait(u);
+    }
+    i += n;
+  }
+}
+
+static void uring_close(struct device* dev){
+  struct uring* u = dev->data;
+  close(u->fd);
+  munmap(u->sqes,u->sqes_size);
+  if(u->cq_ring != u->sq_ring)
+    munmap(u->cq_ring,u->cq_ring_size);
+  munmap(u->sq_ring,u->sq_ring_size);
+  // Abandoned reads may still be in flight, their buffers are left alone
+  for(size_t i=0; i<u->slot_count; i++)
+    if(u->slot[i].state == SLOT_FREE)
+      free(u->slot[i].buf);
+  free(u);
+}
+
+static const struct device_ops uring_ops = {
+  .name = "io_uring",
+  .read = uring_read,
+  .close = uring_close
+};
+
+/*
+ * Each read takes up to two entries, one for the read and one for its timeout. There are
+ * twice as many slots as reads in flight, so a few abandoned reads don't stall everything.
+ * Returns false with errno set if io_uring or one of the operations used isn't available.
+ */
+bool device_open_uring(struct device* dev, int fd, unsigned depth, uint64_t timeout){
+  int err;
+  size_t slot_count = 2 * depth;
+  struct uring* u = calloc(1,sizeof(*u)+slot_count*sizeof(struct slot));
+  if(!u)
+    return false;
+  u->slot_count = slot_count;
+  struct io_uring_params params;
+  memset(&params,0,sizeof(params));
+  u->fd = io_uring_setup(2*slot_count,&params);
+  if(u->fd < 0){
+    err = errno;
+    free(u);
+    errno = err;
+    return false;
+  }
+  if(!uring_supported(u->fd))
+    goto error;
+  u->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  u->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if(params.features & IORING_FEAT_SINGLE_MMAP && u->cq_ring_size > u->sq_ring_size)
+    u->sq_ring_size = u->cq_ring_size;
+  u->sq_ring = mmap(0,u->sq_ring_size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,u->fd,IORING_OFF_SQ_RING);
+  if(u->sq_ring == MAP_FAILED)
+    goto error;
+  u->cq_ring = u->sq_ring;
+  if(!(params.features & IORING_FEAT_SINGLE_MMAP)){
+    u->cq_ring = mmap(0,u->cq_ring_size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,u->fd,IORING_OFF_CQ_RING);
+    if(u->cq_ring == MAP_FAILED)
+      goto error_sq;
+  }
+  u->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  u->sqes = mmap(0,u->sqes_size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,u->fd,IORING_OFF_SQES);
+  if(u->sqes == MAP_FAILED)
+    goto error_cq;
+  char* sq = u->sq_ring;
+  char* cq = u->cq_ring;
+  u->sq_head = (unsigned*)(sq + params.sq_off.head);
+  u->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+  u->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+  u->sq_array = (unsigned*)(sq + params.sq_off.array);
+  u->cq_head = (unsigned*)(cq + params.cq_off.head);
+  u->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+  u->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+  u->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+  *dev = (struct device){
+    .ops = &uring_ops,
+    .fd = fd,
+    .depth = depth,
+    .timeout = timeout,
+    .data = u
+  };
+  return true;
+
+error_cq:
+  err = errno;
+  if(u->cq_ring != u->sq_ring)
+    munmap(u->cq_ring,u->cq_ring_size);
+  errno = err;
+error_sq:
+  err = errno;
+  munmap(u->sq_ring,u->sq_ring_size);
+  errno = err;
+error:
+  err = errno;
+  close(u->fd);
+  free(u);
+  errno = err;
+  return false;
+}
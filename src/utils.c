@@ -67,6 +67,15 @@ bool parseu64(const char** str, uint64_t* ret){
   return true;
 }
 
+// Parses name=value, leaving s after the value
+bool parse_option(const char** s, const char* name, uint64_t* value){
+  size_t n = strlen(name);
+  if(strncmp(*s,name,n) || (*s)[n] != '=')
+    return false;
+  *s += n + 1;
+  return parseu64(s,value);
+}
+
 int u64toa(uint64_t x, char r[18]){
   int i = 18;
   do {